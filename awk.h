@@ -87,6 +87,8 @@ extern int	lineno;		/* line number in awk program */
 extern int	errorflag;	/* 1 if error has occurred */
 extern bool	donefld;	/* true if record broken into fields */
 extern bool	donerec;	/* true if record is valid (no fld has changed */
+extern int	maxfield;	/* highest $n used by program, -1 if unknown */
+extern int	*fsbound;	/* fields found by splitws, splitch; lib.c */
 extern int	dbg;
 
 extern const char *patbeg;	/* beginning of pattern matched */
@@ -100,7 +102,7 @@ typedef struct Cell {
 	char	*nval;		/* name, for variables only */
 	char	*sval;		/* string value */
 	Awkfloat fval;		/* value as number */
-	int	 tval;		/* type info: STR|NUM|ARR|FCN|FLD|CON|DONTFREE|CONVC|CONVO */
+	int	 tval;		/* type info: STR|NUM|ARR|FCN|FLD|CON|DONTFREE|CONVC|CONVO|LAZY|MAYBENUM */
 	char	*fmt;		/* CONVFMT/OFMT value used to convert from number */
 	struct Cell *cnext;	/* ptr to next if chained */
 } Cell;
@@ -137,6 +139,8 @@ extern Cell	*symtabloc;	/* SYMTAB */
 #define	REC	0200	/* this is $0 */
 #define CONVC	0400	/* string was converted from number via CONVFMT */
 #define CONVO	01000	/* string was converted from number via OFMT */
+#define LAZY	02000	/* field not yet copied out of $0; see fldbld */
+#define MAYBENUM 04000	/* input string, not yet checked for a number */
 
 
 /* function types */
@@ -226,6 +230,32 @@ extern	int	pairstack[], paircnt;
 /* #define freeable(p)	(!((p)->tval & DONTFREE)) */
 #define freeable(p)	( ((p)->tval & (STR|DONTFREE)) == STR )
 
+/* block-buffered input, one per input stream; lib.c */
+
+#define	INBUFSIZE	(64 * 1024)	/* size of one read() */
+#define	MAPSIZE		(8 * 1024 * 1024)	/* size of one mmap() window */
+
+extern bool	usemmap;	/* map regular input files; --no-mmap */
+
+typedef struct Inbuf {
+	FILE	*fp;		/* stream it belongs to */
+	char	*buf;		/* read() buffer, size bytes */
+	size_t	size;
+	char	*base;		/* current data, buf or a mapped window; */
+	char	*pos;		/* unconsumed part is pos..end */
+	char	*end;
+	bool	eof;		/* read() has returned 0 or failed */
+	bool	err;		/* read() failed */
+	bool	mapped;		/* regular file read through mmap() windows */
+	char	*map;		/* current window, maplen bytes */
+	size_t	maplen;
+	off_t	off;		/* file offset of next window */
+	off_t	fsize;		/* file size when first seen */
+	struct Inbuf *next;
+} Inbuf;
+
+#define	ibgetc(ib)	((ib)->pos < (ib)->end ? (uschar) *(ib)->pos++ : inbufgetc(ib))
+
 /* structures used by regular expression matching machinery, mostly b.c: */
 
 #define NCHARS	(1256+3)		/* 256 handles 8-bit chars; 128 does 7-bit */
@@ -234,15 +264,22 @@ extern	int	pairstack[], paircnt;
 #define	HAT	(NCHARS+2)	/* matches ^ in regular expr */
 #define NSTATES	32
 
+typedef struct Ccl {	/* character class; cclenter */
+	uint32_t bits[8];	/* its runes below 256 */
+	int	nrange;		/* the rest, as sorted, disjoint */
+	int	*range;		/* lo, hi pairs; in the same block */
+} Ccl;
+
 typedef struct rrow {
 	long	ltype;	/* long avoids pointer warnings on 64-bit */
 	union {
 		int i;
 		Node *np;
 		uschar *up;
-		int *rp; /* rune representation of char class */
+		Ccl *cp; /* char class */
 	} lval;		/* because Al stores a pointer in it! */
-	int	*lfollow;
+	int	*lfollow;	/* in the fa's arena, maybe shared */
+	int	lmin, lmax;	/* a counter for x{lmin,lmax} if lmax > 0; cntstep */
 } rrow;
 
 typedef struct gtte { /* gototab entry */
@@ -256,6 +293,8 @@ typedef struct gtt {	/* gototab */
 	gtte	*entries;
 } gtt;
 
+#define	NESC	7	/* most bytes but NUL a looping state may be left on */
+
 typedef struct fa {
 	gtt	*gototab;
 	uschar	*out;
@@ -263,12 +302,56 @@ typedef struct fa {
 	int	**posns;
 	int	state_count;
 	bool	anchor;
-	int	use;
+	unsigned hash;		/* of restr and anchor, if cached; makedfa */
+	struct	fa *hnext;	/* next in its hash chain */
+	struct	fa *older;	/* neighbours in order of last use */
+	struct	fa *newer;
 	int	initstat;
 	int	curstat;
 	int	accept;
+	int	nclass;		/* runes < 256 fall into this many classes */
+	uschar	cls[256];	/* class of each rune < 256 */
+	int	*trans;		/* nclass next states per state, 0 if unknown */
+	uschar	*loop;		/* per state: times seen going to itself, LOOPS or NOLOOP */
+	char	(*esc)[NESC+1];	/* if LOOPS, the bytes that leave it; loopskip */
+	int	*stab;		/* hash table of states by position set; cgoto */
+	int	nstab;
+	int	nbase;		/* states 0..nbase are never flushed; flushdfa */
+	int	maxstat;	/* flush the rest rather than go past this */
+	int	freeat;		/* look for a flushed number from here */
+	int	nflush;		/* times flushed */
+	long	nmade;		/* states made by cgoto since then */
+	long	ncomputed;	/* and transitions it worked out */
+	int	nthrash;	/* flushes in a row that found little reuse */
+	bool	nocache;	/* thrashing: don't keep transitions */
+	int	nrule;		/* > 0: one FINAL per rule, for a Multi */
+	struct	Multi *multi;	/* else matched as part of this, */
+	int	rule;		/* as this rule */
+	int	litlen;		/* it only matches must, this long; else 0 */
+	char	*must;		/* every match contains this, or NULL */
+	char	*pre;		/* every match starts with this, or NULL */
+	uschar	*first;		/* else first[c] if a match can start with c, or NULL */
+	struct	Ac *ac;	/* a list of strings, matched with a trie; else NULL */
+	struct	Arena *arena;	/* where the follow sets are */
 	struct	rrow re[1];	/* variable: actual size set by calling malloc */
 } fa;
 
+typedef struct Resite {	/* where a dynamic regular expression is used */
+	fa	*pfa;		/* the fa it used last time */
+	unsigned gen;		/* fagen then; it may have been freed since */
+} Resite;
+
+typedef struct Multi {	/* patterns of several rules, matched as one; multidfa */
+	fa	*pfa;		/* their regular expressions, each with its FINAL */
+	int	nrule;
+	uint32_t *hit;		/* rules whose pattern matches rec */
+	char	*rec;		/* the last $0 they were matched against */
+	size_t	reclen;
+	size_t	recsize;
+} Multi;
+
+extern int	nrecache;	/* dynamic fa's to cache; --recache */
+extern int	nrestates;	/* states an fa may keep; --restates */
+
 
 #include "proto.h"
@@ -50,7 +50,7 @@ Node	*arglist = 0;	/* list of args for current function */
 %token	<i>	NL ',' '{' '(' '|' ';' '/' ')' '}' '[' ']'
 %token	<i>	ARRAY
 %token	<i>	MATCH NOTMATCH MATCHOP
-%token	<i>	FINAL DOT ALL CCL NCCL CHAR OR STAR QUEST PLUS EMPTYRE ZERO
+%token	<i>	FINAL DOT ALL CCL NCCL CHAR OR STAR QUEST PLUS EMPTYRE ZERO REPEAT
 %token	<i>	AND BOR APPEND EQ GE GT LE LT NE IN
 %token	<i>	ARG BLTIN BREAK CLOSE CONTINUE DELETE DO EXIT FOR FUNC
 %token	<i>	SUB GSUB IF INDEX LSUBSTR MATCHFCN NEXT NEXTFILE
@@ -197,7 +197,7 @@ patlist:
 	;
 
 ppattern:
-	  var ASGNOP ppattern		{ $$ = op2($2, $1, $3); }
+	  var ASGNOP ppattern		{ $$ = op2($2, fieldset($1), $3); }
 	| ppattern '?' ppattern ':' ppattern %prec '?'
 	 	{ $$ = op3(CONDEXPR, notnull($1), $3, $5); }
 	| ppattern bor ppattern %prec BOR
@@ -210,7 +210,7 @@ ppattern:
 			$$ = op3($2, NIL, $1, (Node*)makedfa(strnode($3), 0));
 			free($3);
 		  } else
-			$$ = op3($2, (Node *)1, $1, $3); }
+			$$ = op3($2, (Node *)resite(), $1, $3); }
 	| ppattern IN varname		{ $$ = op2(INTEST, $1, makearr($3)); }
 	| '(' plist ')' IN varname	{ $$ = op2(INTEST, $2, makearr($5)); }
 	| ppattern term %prec CAT	{ $$ = op2(CAT, $1, $2); }
@@ -219,7 +219,7 @@ ppattern:
 	;
 
 pattern:
-	  var ASGNOP pattern		{ $$ = op2($2, $1, $3); }
+	  var ASGNOP pattern		{ $$ = op2($2, fieldset($1), $3); }
 	| pattern '?' pattern ':' pattern %prec '?'
 	 	{ $$ = op3(CONDEXPR, notnull($1), $3, $5); }
 	| pattern bor pattern %prec BOR
@@ -238,12 +238,12 @@ pattern:
 			$$ = op3($2, NIL, $1, (Node*)makedfa(strnode($3), 0));
 			free($3);
 		  } else
-			$$ = op3($2, (Node *)1, $1, $3); }
+			$$ = op3($2, (Node *)resite(), $1, $3); }
 	| pattern IN varname		{ $$ = op2(INTEST, $1, makearr($3)); }
 	| '(' plist ')' IN varname	{ $$ = op2(INTEST, $2, makearr($5)); }
 	| pattern '|' GETLINE var	{
 			if (safe) SYNTAX("cmd | getline is unsafe");
-			else $$ = op3(GETLINE, $4, itonp($2), $1); }
+			else $$ = op3(GETLINE, fieldset($4), itonp($2), $1); }
 	| pattern '|' GETLINE		{
 			if (safe) SYNTAX("cmd | getline is unsafe");
 			else $$ = op3(GETLINE, (Node*)0, itonp($2), $1); }
@@ -357,7 +357,7 @@ string:
 	;
 
 term:
- 	  term '/' ASGNOP term		{ $$ = op2(DIVEQ, $1, $4); }
+ 	  term '/' ASGNOP term		{ $$ = op2(DIVEQ, fieldset($1), $4); }
  	| term '+' term			{ $$ = op2(ADD, $1, $3); }
 	| term '-' term			{ $$ = op2(MINUS, $1, $3); }
 	| term '*' term			{ $$ = op2(MULT, $1, $3); }
@@ -373,13 +373,13 @@ term:
 	| CALL '(' ')'			{ $$ = op2(CALL, celltonode($1,CVAR), NIL); }
 	| CALL '(' patlist ')'		{ $$ = op2(CALL, celltonode($1,CVAR), $3); }
 	| CLOSE term			{ $$ = op1(CLOSE, $2); }
-	| DECR var			{ $$ = op1(PREDECR, $2); }
-	| INCR var			{ $$ = op1(PREINCR, $2); }
-	| var DECR			{ $$ = op1(POSTDECR, $1); }
-	| var INCR			{ $$ = op1(POSTINCR, $1); }
-	| GETLINE var LT term		{ $$ = op3(GETLINE, $2, itonp($3), $4); }
+	| DECR var			{ $$ = op1(PREDECR, fieldset($2)); }
+	| INCR var			{ $$ = op1(PREINCR, fieldset($2)); }
+	| var DECR			{ $$ = op1(POSTDECR, fieldset($1)); }
+	| var INCR			{ $$ = op1(POSTINCR, fieldset($1)); }
+	| GETLINE var LT term		{ $$ = op3(GETLINE, fieldset($2), itonp($3), $4); }
 	| GETLINE LT term		{ $$ = op3(GETLINE, NIL, itonp($2), $3); }
-	| GETLINE var			{ $$ = op3(GETLINE, $2, NIL, NIL); }
+	| GETLINE var			{ $$ = op3(GETLINE, fieldset($2), NIL, NIL); }
 	| GETLINE			{ $$ = op3(GETLINE, NIL, NIL, NIL); }
 	| INDEX '(' pattern comma pattern ')'
 		{ $$ = op2(INDEX, $3, $5); }
@@ -394,14 +394,14 @@ term:
 			$$ = op3(MATCHFCN, NIL, $3, (Node*)makedfa(strnode($5), 1));
 			free($5);
 		  } else
-			$$ = op3(MATCHFCN, (Node *)1, $3, $5); }
+			$$ = op3(MATCHFCN, (Node *)resite(), $3, $5); }
 	| NUMBER			{ $$ = celltonode($1, CCON); }
 	| SPLIT '(' pattern comma varname comma pattern ')'     /* string */
-		{ $$ = op4(SPLIT, $3, makearr($5), $7, (Node*)STRING); }
+		{ $$ = op5(SPLIT, $3, makearr($5), $7, (Node*)STRING, (Node*)resite()); }
 	| SPLIT '(' pattern comma varname comma reg_expr ')'    /* const /regexp/ */
-		{ $$ = op4(SPLIT, $3, makearr($5), (Node*)makedfa($7, 1), (Node *)REGEXPR); free($7); }
+		{ $$ = op5(SPLIT, $3, makearr($5), (Node*)makedfa($7, 1), (Node *)REGEXPR, NIL); free($7); }
 	| SPLIT '(' pattern comma varname ')'
-		{ $$ = op4(SPLIT, $3, makearr($5), NIL, (Node*)STRING); }  /* default */
+		{ $$ = op5(SPLIT, $3, makearr($5), NIL, (Node*)STRING, (Node*)resite()); }  /* default */
 	| SPRINTF '(' patlist ')'	{ $$ = op1($1, $3); }
 	| string	 		{ $$ = celltonode($1, CCON); }
 	| subop '(' reg_expr comma pattern ')'
@@ -411,15 +411,15 @@ term:
 			$$ = op4($1, NIL, (Node*)makedfa(strnode($3), 1), $5, rectonode());
 			free($3);
 		  } else
-			$$ = op4($1, (Node *)1, $3, $5, rectonode()); }
+			$$ = op4($1, (Node *)resite(), $3, $5, rectonode()); }
 	| subop '(' reg_expr comma pattern comma var ')'
-		{ $$ = op4($1, NIL, (Node*)makedfa($3, 1), $5, $7); free($3); }
+		{ $$ = op4($1, NIL, (Node*)makedfa($3, 1), $5, fieldset($7)); free($3); }
 	| subop '(' pattern comma pattern comma var ')'
 		{ if (constnode($3)) {
-			$$ = op4($1, NIL, (Node*)makedfa(strnode($3), 1), $5, $7);
+			$$ = op4($1, NIL, (Node*)makedfa(strnode($3), 1), $5, fieldset($7));
 			free($3);
 		  } else
-			$$ = op4($1, (Node *)1, $3, $5, $7); }
+			$$ = op4($1, (Node *)resite(), $3, $5, fieldset($7)); }
 	| SUBSTR '(' pattern comma pattern comma pattern ')'
 		{ $$ = op3(SUBSTR, $3, $5, $7); }
 	| SUBSTR '(' pattern comma pattern ')'
@@ -430,8 +430,8 @@ term:
 var:
 	  varname
 	| varname '[' patlist ']'	{ $$ = op2(ARRAY, makearr($1), $3); }
-	| IVAR				{ $$ = op1(INDIRECT, celltonode($1, CVAR)); }
-	| INDIRECT term	 		{ $$ = op1(INDIRECT, $2); }
+	| IVAR				{ $$ = fieldref(celltonode($1, CVAR)); }
+	| INDIRECT term	 		{ $$ = fieldref($2); }
 	;
 
 varlist:
@@ -443,9 +443,10 @@ varlist:
 	;
 
 varname:
-	  VAR			{ $$ = celltonode($1, CVAR); }
+	  VAR			{ if ($1 == symtabloc) maxfield = -1;	/* SYMTAB["NF"] */
+				  $$ = celltonode($1, CVAR); }
 	| ARG 			{ $$ = op1(ARG, itonp($1)); }
-	| VARNF			{ $$ = op1(VARNF, (Node *) $1); }
+	| VARNF			{ maxfield = -1; $$ = op1(VARNF, (Node *) $1); }
 	;
 
 
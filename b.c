@@ -50,6 +50,7 @@ THIS SOFTWARE.
 	leaf (CCL, NCCL, CHAR, DOT, FINAL, ALL, EMPTYRE):
 		left is index, right contains value or pointer to value
 	unary (STAR, PLUS, QUEST): left is child, right is null
+	repeat (REPEAT): left is a leaf, right and narg[2] are n and m
 	binary (CAT, OR): left and right are children
 	parent contains pointer to parent
 */
@@ -61,14 +62,10 @@ int	maxsetvec = 0;
 
 int	rtok;		/* next token in current re */
 int	rlxval;
-static const uschar	*rlxstr;
+static Ccl	*rlxccl;	/* class relex has just read */
+static int	rlxmin, rlxmax;	/* bounds of {n,m} relex has just read */
 static const uschar	*prestr;	/* current position in current re */
 static const uschar	*lastre;	/* origin of last re */
-static const uschar	*lastatom;	/* origin of last Atom */
-static const uschar	*starttok;
-static const uschar 	*basestr;	/* starts with original, replaced during
-				   repetition processing */
-static const uschar 	*firstbasestr;
 
 static	int setcnt;
 static	int poscnt;
@@ -76,9 +73,25 @@ static	int poscnt;
 const char	*patbeg;
 int	patlen;
 
-#define	NFA	128	/* cache this many dynamic fa's */
-fa	*fatab[NFA];
-int	nfatab	= 0;	/* entries in fatab */
+/*
+ * Dynamic regular expressions are cached, since a program mostly
+ * makes the same few over and over.  fahash chains them by a hash
+ * of the string and anchor; they are also on a list in order of last
+ * use, so when the cache is full the least recently used one can be
+ * freed at once.  fagen counts the ones freed, so that a Resite can
+ * tell whether the fa it remembers is still there.
+ */
+
+#define	NFA	128	/* cache this many dynamic fa's, by default */
+int	nrecache = NFA;
+static	fa	**fahash;	/* nfahash chains */
+static	int	nfahash;	/* a power of 2 */
+int	nfatab	= 0;	/* entries in fahash */
+static	fa	*newest, *oldest;	/* ends of the use list */
+static	unsigned fagen;
+
+#define	NRESTATES	10000	/* states an fa keeps before flushing, by default */
+int	nrestates = NRESTATES;
 
 extern int u8_nextlen(const char *s);
 
@@ -102,9 +115,13 @@ extern int u8_nextlen(const char *s);
    Throughout the RE mechanism in b.c, utf-8 characters are
    converted to their utf-32 value.  This mostly shows up in
    cclenter, which expands character class ranges like a-z and now
-   alpha-omega.  The size of a gototab array is still about 256.
-   This should be dynamic, but for now things work ok for a single
-   code page of Unicode, which is the most likely case.
+   alpha-omega.  The gototab holds transitions on characters of
+   256 and up (128 and up with utf-8); it grows as needed.
+
+   The matchers themselves run on bytes, through a table per state
+   indexed by byte class; states part way through a multi-byte
+   character get a character's transition out of its last byte.
+   See byteclasses and bytestep.
 
    The code changes are localized in run.c and b.c.  I have added a
    handful of functions to somewhat better hide the implementation,
@@ -117,6 +134,22 @@ static int get_gototab(fa*, int, int);
 static int set_gototab(fa*, int, int, int);
 static void clear_gototab(fa*, int);
 extern int u8_rune(int *, const char *);
+extern int u8_runen(int *, const char *, size_t);
+
+static int bytestep(fa *, int, int, int *);
+static void remakestab(fa *);
+static int cclsole(const Ccl *);
+static bool isout(fa *, const int *);
+static int bgoto(fa *, int, int, int *);
+static bool looping(fa *, int);
+static const uschar *loopskip(fa *, int, const uschar *);
+static int bydesc(const void *, const void *);
+static int setpos(fa *, int);
+static bool isleaf(Node *);
+static Node *repeat(Node *, int, int);
+static struct Ac *mkac(const char *);
+static void freeac(struct Ac *);
+static int acmatch(fa *, const char *, bool);
 
 static int *
 intalloc(size_t n, const char *f)
@@ -130,6 +163,8 @@ intalloc(size_t n, const char *f)
 static void
 resizesetvec(const char *f)
 {
+	int old = maxsetvec;
+
 	if (maxsetvec == 0)
 		maxsetvec = MAXLIN;
 	else
@@ -138,6 +173,7 @@ resizesetvec(const char *f)
 	tmpset = (int *) realloc(tmpset, maxsetvec * sizeof(*tmpset));
 	if (setvec == NULL || tmpset == NULL)
 		overflo(f);
+	memset(setvec + old, 0, (maxsetvec - old) * sizeof(*setvec));
 }
 
 static void
@@ -146,12 +182,16 @@ resize_state(fa *f, int state)
 	gtt *p;
 	uschar *p2;
 	int **p3;
+	int *p4;
+	char (*p5)[NESC+1];
 	int i, new_count;
 
 	if (++state < f->state_count)
 		return;
 
-	new_count = state + 10; /* needs to be tuned */
+	new_count = f->state_count > 0 ? 2 * f->state_count : 8;
+	if (new_count < state)
+		new_count = state;
 
 	p = (gtt *) realloc(f->gototab, new_count * sizeof(gtt));
 	if (p == NULL)
@@ -168,11 +208,27 @@ resize_state(fa *f, int state)
 		goto out;
 	f->posns = p3;
 
+	p4 = (int *) realloc(f->trans, new_count * f->nclass * sizeof(int));
+	if (p4 == NULL)
+		goto out;
+	f->trans = p4;
+	memset(p4 + f->state_count * f->nclass, 0,
+		(new_count - f->state_count) * f->nclass * sizeof(int));
+
+	p2 = (uschar *) realloc(f->loop, new_count * sizeof(f->loop[0]));
+	if (p2 == NULL)
+		goto out;
+	f->loop = p2;
+	memset(p2 + f->state_count, 0, new_count - f->state_count);
+
+	p5 = realloc(f->esc, new_count * sizeof(f->esc[0]));
+	if (p5 == NULL)
+		goto out;
+	f->esc = p5;
+
 	for (i = f->state_count; i < new_count; ++i) {
-		f->gototab[i].entries = (gtte *) calloc(NCHARS, sizeof(gtte));
-		if (f->gototab[i].entries == NULL)
-			goto out;
-		f->gototab[i].allocated = NCHARS;
+		f->gototab[i].entries = NULL;	/* see set_gototab */
+		f->gototab[i].allocated = 0;
 		f->gototab[i].inuse = 0;
 		f->out[i] = 0;
 		f->posns[i] = NULL;
@@ -183,11 +239,437 @@ out:
 	overflo(__func__);
 }
 
+/*
+ * The dfa runs on bytes.  Each state has a row of next states,
+ * indexed by the class of the byte, instead of the sorted gototab.
+ * Bytes that no leaf of the regular expression tells apart share a
+ * class: each CHAR, CCL or NCCL splits the classes it cuts across,
+ * and so does NUL, which DOT, ALL and NCCL never match.
+ *
+ * With utf-8, a byte that starts a multi-byte character leads to a
+ * state that stands for the original state part way through it;
+ * the byte that finishes it goes where the character would, and a
+ * byte that doesn't fit sends the matcher back to treat the first
+ * byte as a character by itself, as u8_rune does.  See bytestep.
+ * Characters above 127 are then told apart by their bytes, so if
+ * the regular expression names any, each of those bytes is a class
+ * of its own; if not, all that matters is what kind of byte it is.
+ */
+
+static bool onebyte(int c)	/* is the rune c also the byte c? */
+{
+	return (unsigned) c < (awk_mb_cur_max == 1 ? 256 : 128);
+}
+
+static int seqlen(int c)	/* length of utf-8 sequence starting with c, or 1 */
+{
+	if (awk_mb_cur_max == 1 || c < 0xC0 || c > 0xF7)
+		return 1;
+	return c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+}
+
+static void refine(fa *f, const uschar *in)	/* split classes by in[] */
+{
+	int to[256][2];
+	int c, k, n;
+
+	for (k = 0; k < f->nclass; k++)
+		to[k][0] = to[k][1] = -1;
+	n = 0;
+	for (c = 0; c < 256; c++) {
+		k = f->cls[c];
+		if (to[k][in[c]] < 0)
+			to[k][in[c]] = n++;
+		f->cls[c] = to[k][in[c]];
+	}
+	f->nclass = n;
+}
+
+static void refinerange(fa *f, int lo, int hi)	/* split classes by lo..hi */
+{
+	uschar in[256];
+
+	memset(in, 0, sizeof(in));
+	memset(in + lo, 1, hi - lo + 1);
+	refine(f, in);
+}
+
+static void byteclasses(fa *f)	/* compute f->cls and f->nclass */
+{
+	uschar in[256];
+	int i, c;
+	Ccl *cp;
+	bool wide = false;	/* some leaf names a non-ascii utf-8 character */
+
+	memset(f->cls, 0, sizeof(f->cls));
+	f->nclass = 1;
+	refinerange(f, 0, 0);
+	for (i = 0; i <= f->accept; i++) {
+		memset(in, 0, sizeof(in));
+		switch (f->re[i].ltype) {
+		case CHAR:
+			if ((c = ptoi(f->re[i].lval.np)) == HAT)
+				continue;
+			if (!onebyte(c)) {
+				wide = true;
+				continue;
+			}
+			in[c] = 1;
+			break;
+		case CCL:
+		case NCCL:
+			cp = f->re[i].lval.cp;
+			for (c = 1; c < 256; c++)
+				if (!member(c, cp))
+					continue;
+				else if (onebyte(c))
+					in[c] = 1;
+				else
+					wide = true;
+			if (cp->nrange > 0)
+				wide = true;
+			break;
+		default:
+			continue;
+		}
+		refine(f, in);
+	}
+	if (awk_mb_cur_max == 1)
+		return;
+	refinerange(f, 0x80, 0xFF);
+	if (wide) {
+		for (c = 0x80; c <= 0xFF; c++)
+			refinerange(f, c, c);
+	} else {
+		refinerange(f, 0x80, 0xBF);	/* continuations */
+		refinerange(f, 0xC0, 0xDF);	/* leads of 2 */
+		refinerange(f, 0xE0, 0xEF);	/* 3 */
+		refinerange(f, 0xF0, 0xF7);	/* and 4 */
+	}
+}
+
+/*
+ * Literal factors.  Before running the dfa, match, pmatch and
+ * nematch look for a string every match contains (must), a string
+ * every match starts with (pre), or failing that the bytes a match
+ * can start with (first), so that lines without a match are turned
+ * down, and places where none can start are skipped, by strstr or
+ * a table lookup.  A regular expression that only matches one
+ * string doesn't need the dfa at all (litlen).  With utf-8,
+ * characters 128 to 255 are not literal, since the dfa also takes
+ * those bytes on their own for them.
+ */
+
+#define	LITMAX	64
+
+typedef struct Lit {	/* what all matches of part of a regular expression share */
+	bool	exact;		/* pre is the only match */
+	bool	empty;		/* it can match without using up a byte */
+	char	pre[LITMAX+1];	/* every match starts with this, */
+	char	suf[LITMAX+1];	/* ends with this */
+	char	in[LITMAX+1];	/* and contains this */
+	uint32_t first[8];	/* bytes a match can start with */
+} Lit;
+
+extern int runetochar(char *, int);
+
+#define	setfirst(l, c)	((l)->first[(c) >> 5] |= 1u << ((c) & 31))
+#define	isfirst(l, c)	((l)->first[(c) >> 5] & 1u << ((c) & 31))
+
+static void litcat(char *d, const char *a, const char *b, bool tail)
+{	/* d = a b, keeping the head, or the tail, if that is too long */
+	char t[2*LITMAX+1];
+	size_t n;
+
+	snprintf(t, sizeof(t), "%s%s", a, b);
+	n = strlen(t);
+	if (n > LITMAX) {
+		if (tail)
+			memmove(t, t + n - LITMAX, LITMAX);
+		t[LITMAX] = '\0';
+	}
+	strcpy(d, t);
+}
+
+static void longest(char *d, const char *a)	/* d = a if that is longer */
+{
+	if (strlen(a) > strlen(d))
+		strcpy(d, a);
+}
+
+static void litchar(Lit *l, int c)	/* l is the character c */
+{
+	char b[8];
+	int i, n;
+
+	memset(l, 0, sizeof(*l));
+	if (c == HAT) {		/* uses up no bytes, but isn't literal */
+		l->empty = true;
+		return;
+	}
+	if (c == 0 || (!onebyte(c) && c < 256)) {	/* $, or see above */
+		if (c == 0)
+			setfirst(l, 0);
+		else
+			for (i = 0x80; i < 256; i++)
+				setfirst(l, i);
+		return;
+	}
+	if (onebyte(c)) {
+		b[0] = c;
+		n = 1;
+	} else
+		n = runetochar(b, c);
+	b[n] = '\0';
+	l->exact = true;
+	strcpy(l->pre, b);
+	strcpy(l->suf, b);
+	strcpy(l->in, b);
+	setfirst(l, (uschar) b[0]);
+}
+
+static void litleaf(Node *p, Lit *l)	/* work out l for leaf p */
+{
+	Lit r;
+	char mid[LITMAX+1];
+	int i, m, n;
+	Ccl *cp;
+
+	switch (type(p)) {
+	case CHAR:
+		litchar(l, ptoi(right(p)));
+		return;
+	case CCL:
+		cp = (Ccl *) right(p);
+		if ((m = cclsole(cp)) > 0) {	/* [x] */
+			litchar(l, m);
+			return;
+		}
+		memset(l, 0, sizeof(*l));
+		if (m == 0) {	/* () */
+			l->exact = l->empty = true;
+			return;
+		}
+		for (m = 1; m < 256; m++) {
+			if (!member(m, cp))
+				continue;
+			litchar(&r, m);
+			for (i = 0; i < 8; i++)
+				l->first[i] |= r.first[i];
+		}
+		for (i = 0; i < cp->nrange; i++) {	/* utf-8 keeps rune order */
+			runetochar(mid, cp->range[2*i]);
+			m = (uschar) mid[0];
+			runetochar(mid, cp->range[2*i+1]);
+			n = cp->range[2*i+1] > 0xFFFF ? 0xF7 : (uschar) mid[0];
+			for (; m <= n; m++)
+				setfirst(l, m);
+		}
+		return;
+	case NCCL:
+	case DOT:
+	case ALL:
+		memset(l, 0, sizeof(*l));
+		for (i = 1; i < 256; i++)
+			setfirst(l, i);
+		return;
+	case EMPTYRE:
+	case ZERO:
+		memset(l, 0, sizeof(*l));
+		l->exact = l->empty = true;
+		return;
+	}
+	FATAL("can't happen: unknown type %d in lit", type(p));
+}
+
+static void lit(Node *p, Lit *l)	/* work out l for p */
+{
+	static struct {
+		Node	*p;
+		int	done;	/* operands worked out so far */
+	} *stk;
+	static Lit *val;	/* for the operands worked out, in order */
+	static int nstk, nval;
+	char mid[LITMAX+1];
+	int i, m, n, ns = 0, nv = 0;
+	Lit *v, *r;
+
+	for (;;) {
+		if (ns >= nstk || nv + 1 >= nval) {
+			nstk = nval = ns + nv + 64;
+			stk = realloc(stk, nstk * sizeof(*stk));
+			val = (Lit *) realloc(val, nval * sizeof(Lit));
+			if (stk == NULL || val == NULL)
+				overflo(__func__);
+		}
+		if (p != NULL) {	/* start on p */
+			if (type(p) == ZERO || isleaf(p)) {
+				litleaf(p, &val[nv++]);
+				p = NULL;
+			} else {
+				stk[ns].p = p;
+				stk[ns++].done = 0;
+				p = left(p);
+			}
+			continue;
+		}
+		if (ns == 0)
+			break;
+		p = stk[ns-1].p;	/* an operand of p is done */
+		if ((type(p) == CAT || type(p) == OR) && stk[ns-1].done++ == 0) {
+			p = right(p);
+			continue;
+		}
+		ns--;
+		v = &val[nv-1];
+		switch (type(p)) {
+		case PLUS:	/* starts, ends with and contains what its operand does */
+			v->exact = false;
+			break;
+		case STAR:
+		case QUEST:
+			v->exact = false;
+			v->empty = true;
+			v->pre[0] = v->suf[0] = v->in[0] = '\0';
+			break;
+		case REPEAT:	/* x{n,m}: x n times, and maybe more */
+			if (!v->exact)	/* a class */
+				break;
+			strcpy(mid, v->pre);
+			for (i = 1; i < ptoi(right(p)) && strlen(v->pre) < LITMAX; i++) {
+				litcat(v->pre, v->pre, mid, false);
+				litcat(v->suf, v->suf, mid, true);
+			}
+			strcpy(v->in, v->pre);
+			v->exact = ptoi(right(p)) == ptoi(p->narg[2])
+				&& strlen(v->pre) < LITMAX;
+			break;
+		case CAT:
+			r = v--;
+			nv--;
+			litcat(mid, v->suf, r->pre, false);
+			longest(v->in, r->in);
+			longest(v->in, mid);
+			if (v->exact)
+				litcat(v->pre, v->pre, r->pre, false);
+			if (r->exact)
+				litcat(v->suf, v->suf, r->suf, true);
+			else
+				strcpy(v->suf, r->suf);
+			v->exact = v->exact && r->exact && strlen(v->pre) < LITMAX;
+			if (v->empty)
+				for (i = 0; i < 8; i++)
+					v->first[i] |= r->first[i];
+			v->empty = v->empty && r->empty;
+			break;
+		case OR:
+			r = v--;
+			nv--;
+			v->exact = v->exact && r->exact && strcmp(v->pre, r->pre) == 0;
+			for (i = 0; v->pre[i] != '\0' && v->pre[i] == r->pre[i]; i++)
+				;
+			v->pre[i] = '\0';
+			m = strlen(v->suf);
+			n = strlen(r->suf);
+			for (i = 0; i < m && i < n && v->suf[m-1-i] == r->suf[n-1-i]; i++)
+				;
+			memmove(v->suf, v->suf + m - i, i + 1);
+			if (strcmp(v->in, r->in) != 0) {
+				strcpy(v->in, v->pre);
+				longest(v->in, v->suf);
+			}
+			for (i = 0; i < 8; i++)
+				v->first[i] |= r->first[i];
+			v->empty = v->empty || r->empty;
+			break;
+		}
+		p = NULL;
+	}
+	*l = val[0];
+}
+
+static void litfactors(fa *f, Node *p)	/* set litlen, must, pre, first */
+{
+	Lit l;
+	int i, c;
+	bool hat = false;
+
+	lit(p, &l);
+	if (l.exact && l.pre[0] != '\0') {
+		f->litlen = strlen(l.pre);
+		f->must = tostring(l.pre);
+		return;
+	}
+	for (i = 0; i <= f->accept; i++)
+		if (f->re[i].ltype == CHAR && ptoi(f->re[i].lval.np) == HAT)
+			hat = true;
+	if (l.empty || hat) {	/* a match can start anywhere, or only at the start */
+		if (l.in[0] != '\0')
+			f->must = tostring(l.in);
+		return;
+	}
+	if (l.pre[0] != '\0')
+		f->pre = tostring(l.pre);
+	if (l.in[0] != '\0' && strstr(l.pre, l.in) == NULL)
+		f->must = tostring(l.in);
+	if (f->pre != NULL)
+		return;
+	for (c = 1; c < 256; c++)
+		if (!isfirst(&l, c))
+			break;
+	if (c == 256)	/* no help */
+		return;
+	f->first = (uschar *) calloc(256, 1);
+	if (f->first == NULL)
+		overflo(__func__);
+	for (c = 0; c < 256; c++)
+		f->first[c] = isfirst(&l, c) != 0;
+}
+
+static unsigned fahashof(const char *s, bool anchor)
+{
+	unsigned h;
+
+	for (h = anchor; *s != '\0'; s++)
+		h = (uschar) *s + 31 * h;
+	return h;
+}
+
+static void faunlink(fa *f)	/* take f off the use list */
+{
+	if (f->newer != NULL)
+		f->newer->older = f->older;
+	else
+		newest = f->older;
+	if (f->older != NULL)
+		f->older->newer = f->newer;
+	else
+		oldest = f->newer;
+}
+
+static void fapush(fa *f)	/* put f at the new end of the use list */
+{
+	f->older = newest;
+	f->newer = NULL;
+	if (newest != NULL)
+		newest->newer = f;
+	else
+		oldest = f;
+	newest = f;
+}
+
+static void fatouch(fa *f)	/* f has just been used */
+{
+	if (f != newest) {
+		faunlink(f);
+		fapush(f);
+	}
+}
+
 fa *makedfa(const char *s, bool anchor)	/* returns dfa for reg expr s */
 {
-	int i, use, nuse;
-	fa *pfa;
-	static int now = 1;
+	unsigned h;
+	fa *pfa, **pp;
 
 	if (setvec == NULL) {	/* first time through any RE */
 		resizesetvec(__func__);
@@ -195,81 +677,240 @@ fa *makedfa(const char *s, bool anchor)	/* returns dfa for reg expr s */
 
 	if (compile_time != RUNNING)	/* a constant for sure */
 		return mkdfa(s, anchor);
-	for (i = 0; i < nfatab; i++)	/* is it there already? */
-		if (fatab[i]->anchor == anchor
-		  && strcmp((const char *) fatab[i]->restr, s) == 0) {
-			fatab[i]->use = now++;
-			return fatab[i];
+	if (fahash == NULL) {
+		for (nfahash = 16; nfahash < nrecache; nfahash *= 2)
+			;
+		fahash = (fa **) calloc(nfahash, sizeof(*fahash));
+		if (fahash == NULL)
+			overflo(__func__);
+	}
+	h = fahashof(s, anchor);
+	for (pfa = fahash[h & (nfahash-1)]; pfa != NULL; pfa = pfa->hnext)
+		if (pfa->hash == h && pfa->anchor == anchor	/* there already */
+		  && strcmp((const char *) pfa->restr, s) == 0) {
+			fatouch(pfa);
+			return pfa;
 		}
+	if (nfatab >= nrecache) {	/* replace least-recently used */
+		pfa = oldest;
+		faunlink(pfa);
+		for (pp = &fahash[pfa->hash & (nfahash-1)]; *pp != pfa; pp = &(*pp)->hnext)
+			;
+		*pp = pfa->hnext;
+		DPRINTF("freeing fa /%s/, %zu bytes\n", pfa->restr, fabytes(pfa));
+		freefa(pfa);
+		fagen++;
+		nfatab--;
+	}
 	pfa = mkdfa(s, anchor);
-	if (nfatab < NFA) {	/* room for another */
-		fatab[nfatab] = pfa;
-		fatab[nfatab]->use = now++;
-		nfatab++;
+	pfa->hash = h;
+	pfa->hnext = fahash[h & (nfahash-1)];
+	fahash[h & (nfahash-1)] = pfa;
+	fapush(pfa);
+	nfatab++;
+	return pfa;
+}
+
+/*
+ * makedfa for a call site that may well ask for the same one again.
+ * The site's string may have been changed in place or freed and a
+ * new one put at the same address, so it has to be compared, but
+ * that is all the looking up it needs.
+ */
+
+fa *sitedfa(Resite *site, const char *s, bool anchor)
+{
+	fa *pfa = site->pfa;
+
+	if (pfa != NULL && site->gen == fagen && pfa->anchor == anchor
+	  && strcmp((const char *) pfa->restr, s) == 0) {
+		fatouch(pfa);
 		return pfa;
 	}
-	use = fatab[0]->use;	/* replace least-recently used */
-	nuse = 0;
-	for (i = 1; i < nfatab; i++)
-		if (fatab[i]->use < use) {
-			use = fatab[i]->use;
-			nuse = i;
-		}
-	freefa(fatab[nuse]);
-	fatab[nuse] = pfa;
-	pfa->use = now++;
+	pfa = makedfa(s, anchor);
+	if (compile_time == RUNNING) {	/* else it isn't cached */
+		site->pfa = pfa;
+		site->gen = fagen;
+	}
 	return pfa;
 }
 
-fa *mkdfa(const char *s, bool anchor)	/* does the real work of making a dfa */
-				/* anchor = true for anchored matches, else false */
+Resite *resite(void)	/* a Resite for a new call site */
 {
-	Node *p, *p1;
-	fa *f;
+	Resite *site;
 
-	firstbasestr = (const uschar *) s;
-	basestr = firstbasestr;
-	p = reparse(s);
-	p1 = op2(CAT, op2(STAR, op2(ALL, NIL, NIL), NIL), p);
-		/* put ALL STAR in front of reg.  exp. */
-	p1 = op2(CAT, p1, op2(FINAL, NIL, NIL));
-		/* put FINAL after reg.  exp. */
+	if ((site = (Resite *) calloc(1, sizeof(*site))) == NULL)
+		overflo(__func__);
+	return site;
+}
+
+static fa *buildfa(Node *p1, Node *p, const char *s, bool anchor, int nrule)
+{		/* dfa for p1, which is ALL STAR, p, FINAL or several of those */
+	fa *f;
 
 	poscnt = 0;
 	penter(p1);	/* enter parent pointers and leaf indices */
 	if ((f = (fa *) calloc(1, sizeof(fa) + poscnt * sizeof(rrow))) == NULL)
 		overflo(__func__);
 	f->accept = poscnt-1;	/* penter has computed number of positions in re */
+	f->nrule = nrule;
 	cfoll(f, p1);	/* set up follow sets */
+	byteclasses(f);
+	if (p != NULL)
+		litfactors(f, p);
 	freetr(p1);
 	resize_state(f, 1);
 	f->posns[0] = intalloc(*(f->re[0].lfollow), __func__);
 	f->posns[1] = intalloc(1, __func__);
 	*f->posns[1] = 0;
+	f->restr = (uschar *) tostring(s);
+	f->maxstat = nrestates;
+	f->nbase = 2;
 	f->initstat = makeinit(f, anchor);
+	f->nbase = f->curstat;	/* split etc. switch between 2 and initstat */
 	f->anchor = anchor;
+	return f;
+}
+
+static fa *dfaof(const char *s, bool anchor)	/* the dfa proper */
+{
+	Node *p, *p1;
+
+	p = reparse(s);
+	p1 = op2(CAT, op2(STAR, op2(ALL, NIL, NIL), NIL), p);
+		/* put ALL STAR in front of reg.  exp. */
+	p1 = op2(CAT, p1, op2(FINAL, NIL, NIL));
+		/* put FINAL after reg.  exp. */
+	return buildfa(p1, p, s, anchor, 0);
+}
+
+fa *mkdfa(const char *s, bool anchor)	/* does the real work of making a dfa */
+				/* anchor = true for anchored matches, else false */
+{
+	struct Ac *a;
+	fa *f;
+
+	if ((a = mkac(s)) == NULL)
+		return dfaof(s, anchor);
+	if ((f = (fa *) calloc(1, sizeof(fa))) == NULL)
+		overflo(__func__);
+	f->ac = a;
 	f->restr = (uschar *) tostring(s);
-	if (firstbasestr != basestr) {
-		if (basestr)
-			xfree(basestr);
-	}
+	f->anchor = anchor;
+	f->initstat = 1;	/* anything but 2; see acmatch */
+	f->curstat = -1;	/* no states */
+	f->accept = -1;		/* and no positions */
 	return f;
 }
 
+/*
+ * A program with many rules like /re/ { ... } would otherwise run a
+ * dfa over each record once for every one of them.  multidfa puts
+ * the regular expressions of such rules into one dfa, each followed
+ * by a FINAL of its own that says which rule it is.  The first of
+ * the rules to be tried on a record runs that over the whole of $0,
+ * noting every rule whose FINAL turns up in a state it goes through;
+ * the others just look at what it found, so long as $0 is still the
+ * same string.  Rules are still tried in order, one at a time, so
+ * an action that changes $0 is seen by the rules after it.
+ */
+
+void multidfa(fa **v, int n)	/* match the patterns v[0..n-1] together */
+{
+	Node *p, *q, *all = NIL;
+	Multi *m;
+	char *s, *t;
+	size_t len = 1;
+	int i;
+
+	for (i = 0; i < n; i++)
+		len += strlen((const char *) v[i]->restr) + 1;
+	if ((s = (char *) malloc(len)) == NULL
+	  || (m = (Multi *) calloc(1, sizeof(*m))) == NULL
+	  || (m->hit = (uint32_t *) calloc((n + 31) / 32, sizeof(*m->hit))) == NULL)
+		overflo(__func__);
+	for (t = s, i = 0; i < n; i++) {	/* r1 FINAL1 | r2 FINAL2 | ... */
+		q = op2(CAT, reparse((const char *) v[i]->restr),
+			op2(FINAL, NIL, itonp(i + 1)));
+		all = all == NIL ? q : op2(OR, all, q);
+		t += sprintf(t, "%s%s", i > 0 ? "|" : "", v[i]->restr);
+	}
+	p = op2(CAT, op2(STAR, op2(ALL, NIL, NIL), NIL), all);
+	m->pfa = buildfa(p, NIL, s, false, n);
+	m->nrule = n;
+	free(s);
+	for (i = 0; i < n; i++) {
+		v[i]->multi = m;
+		v[i]->rule = i;
+	}
+	DPRINTF("%d patterns matched together as /%s/\n", n, m->pfa->restr);
+}
+
+static int multihit(Multi *m, int s)	/* note rules done in state s */
+{				/* and return how many are new */
+	fa *f = m->pfa;
+	int i, r, n = 0, *p = f->posns[s];
+
+	for (i = 1; i <= p[0]; i++)
+		if (p[i] >= 0 && f->re[p[i]].ltype == FINAL) {
+			r = ptoi(f->re[p[i]].lval.np) - 1;
+			if ((m->hit[r >> 5] & 1u << (r & 31)) == 0) {
+				m->hit[r >> 5] |= 1u << (r & 31);
+				n++;
+			}
+		}
+	return n;
+}
+
+int multimatch(fa *pf, const char *p0)	/* match for a rule in a Multi */
+{
+	Multi *m = pf->multi;
+	fa *f = m->pfa;
+	const uschar *p = (const uschar *) p0;
+	size_t len = strlen(p0);
+	int s, ns, c, n, left;
+
+	if (m->rec != NULL && len == m->reclen && memcmp(m->rec, p0, len) == 0)
+		return (m->hit[pf->rule >> 5] >> (pf->rule & 31)) & 1;
+	if (len >= m->recsize) {
+		m->recsize = len + 1;
+		if ((m->rec = (char *) realloc(m->rec, m->recsize)) == NULL)
+			overflo(__func__);
+	}
+	memcpy(m->rec, p0, len);
+	m->reclen = len;
+	memset(m->hit, 0, (m->nrule + 31) / 32 * sizeof(*m->hit));
+	left = m->nrule;
+	s = f->initstat;
+	if (f->out[s])
+		left -= multihit(m, s);
+	while (left > 0) {
+		c = *p;
+		ns = bgoto(f, s, c, &n);
+		if (f->out[ns])
+			left -= multihit(m, ns);
+		p += n;
+		if (c == 0 && n == 1)
+			break;
+		if (ns == s && looping(f, s))
+			p = loopskip(f, s, p);
+		s = ns;
+	}
+	return (m->hit[pf->rule >> 5] >> (pf->rule & 31)) & 1;
+}
+
 int makeinit(fa *f, bool anchor)
 {
 	int i, k;
 
 	f->curstat = 2;
-	f->out[2] = 0;
 	k = *(f->re[0].lfollow);
 	xfree(f->posns[2]);
 	f->posns[2] = intalloc(k + 1,  __func__);
 	for (i = 0; i <= k; i++) {
 		(f->posns[2])[i] = (f->re[0].lfollow)[i];
 	}
-	if ((f->posns[2])[1] == f->accept)
-		f->out[2] = 1;
+	f->out[2] = isout(f, f->posns[2]);
 	clear_gototab(f, 2);
 	f->curstat = cgoto(f, 2, HAT);
 	if (anchor) {
@@ -281,81 +922,235 @@ int makeinit(fa *f, bool anchor)
 		f->out[0] = f->out[2];
 		if (f->curstat != 2)
 			--(*f->posns[f->curstat]);
+		f->nstab = 0;	/* the sets have changed */
 	}
 	return f->curstat;
 }
 
-void penter(Node *p)	/* set up parent pointers and leaf indices */
+/*
+ * The walks over a parse tree use a stack of their own rather than
+ * recursion, since a long regular expression makes a deep tree:
+ * concatenations and alternations lean to the left.  penter lists
+ * the nodes in preorder in tree, so that later walks can go down it
+ * from parents to children, or up it from children to parents.  An
+ * inner node's info is its place there.
+ */
+
+typedef struct Walk {	/* a stack of nodes */
+	Node	**node;
+	int	n;
+	int	size;
+} Walk;
+
+static void push(Walk *w, Node *p)
 {
-	switch (type(p)) {
-	ELEAF
-	LEAF
-		info(p) = poscnt;
-		poscnt++;
-		break;
-	UNARY
-		penter(left(p));
-		parent(left(p)) = p;
-		break;
-	case CAT:
-	case OR:
-		penter(left(p));
-		penter(right(p));
-		parent(left(p)) = p;
-		parent(right(p)) = p;
-		break;
-	case ZERO:
-		break;
-	default:	/* can't happen */
-		FATAL("can't happen: unknown type %d in penter", type(p));
-		break;
+	if (w->n >= w->size) {
+		w->size = w->size > 0 ? 2 * w->size : 64;
+		w->node = (Node **) realloc(w->node, w->size * sizeof(Node *));
+		if (w->node == NULL)
+			overflo(__func__);
 	}
+	w->node[w->n++] = p;
 }
 
-void freetr(Node *p)	/* free parse tree */
+static	Walk	tree;		/* the nodes, in preorder */
+static	uschar	*nul;		/* nul[info(p)]: inner node p matches "" */
+static	int	**fol;		/* fol[info(p)]: what can follow inner node p */
+static	int	ntreemax;	/* size of nul and fol */
+
+static bool isleaf(Node *p)
 {
 	switch (type(p)) {
 	ELEAF
 	LEAF
-		xfree(p);
-		break;
-	UNARY
-	case ZERO:
-		freetr(left(p));
-		xfree(p);
-		break;
-	case CAT:
-	case OR:
-		freetr(left(p));
-		freetr(right(p));
-		xfree(p);
-		break;
-	default:	/* can't happen */
-		FATAL("can't happen: unknown type %d in freetr", type(p));
-		break;
+		return true;
 	}
+	return false;
 }
 
-/* in the parsing of regular expressions, metacharacters like . have */
-/* to be seen literally;  \056 is not a metacharacter. */
+static bool isnul(Node *p)	/* can p match the empty string?  see first */
+{
+	if (!isleaf(p))
+		return nul[info(p)];
+	return type(p) == EMPTYRE
+		|| (type(p) == CCL && cclsole((Ccl *) right(p)) == 0);	/* empty CCL */
+}
 
-int hexstr(const uschar **pp, int max)	/* find and eval hex string at pp, return new p */
-{			/* only pick up one 8-bit byte (2 chars) */
-	const uschar *p;
-	int n = 0;
+void penter(Node *p)	/* set up parent pointers and leaf indices */
+{
+	static Walk w;
 	int i;
 
-	for (i = 0, p = *pp; i < max && isxdigit(*p); i++, p++) {
-		if (isdigit((int) *p))
-			n = 16 * n + *p - '0';
-		else if (*p >= 'a' && *p <= 'f')
-			n = 16 * n + *p - 'a' + 10;
-		else if (*p >= 'A' && *p <= 'F')
-			n = 16 * n + *p - 'A' + 10;
-	}
-	*pp = p;
-	return n;
-}
+	tree.n = 0;
+	push(&w, p);
+	while (w.n > 0) {
+		p = w.node[--w.n];
+		switch (type(p)) {
+		ELEAF
+		LEAF
+			info(p) = poscnt;
+			poscnt++;
+			break;
+		UNARY
+		case REPEAT:
+			parent(left(p)) = p;
+			push(&w, left(p));
+			break;
+		case CAT:
+		case OR:
+			parent(left(p)) = p;
+			parent(right(p)) = p;
+			push(&w, right(p));
+			push(&w, left(p));
+			break;
+		case ZERO:
+			break;
+		default:	/* can't happen */
+			FATAL("can't happen: unknown type %d in penter", type(p));
+			break;
+		}
+		if (!isleaf(p))
+			info(p) = tree.n;
+		push(&tree, p);
+	}
+	if (tree.n > ntreemax) {
+		ntreemax = tree.n;
+		nul = (uschar *) realloc(nul, ntreemax * sizeof(*nul));
+		fol = (int **) realloc(fol, ntreemax * sizeof(*fol));
+		if (nul == NULL || fol == NULL)
+			overflo(__func__);
+	}
+	for (i = tree.n - 1; i >= 0; i--) {	/* children first */
+		p = tree.node[i];
+		switch (type(p)) {
+		case STAR:
+		case QUEST:
+		case ZERO:
+			nul[i] = true;
+			break;
+		case PLUS:
+		case REPEAT:
+			nul[i] = isnul(left(p));
+			break;
+		case CAT:
+			nul[i] = isnul(left(p)) && isnul(right(p));
+			break;
+		case OR:
+			nul[i] = isnul(left(p)) || isnul(right(p));
+			break;
+		}
+	}
+}
+
+void freetr(Node *p)	/* free parse tree */
+{
+	static Walk w;
+
+	push(&w, p);
+	while (w.n > 0) {
+		p = w.node[--w.n];
+		switch (type(p)) {
+		ELEAF
+		LEAF
+			break;
+		UNARY
+		case REPEAT:
+		case ZERO:
+			push(&w, left(p));
+			break;
+		case CAT:
+		case OR:
+			push(&w, left(p));
+			push(&w, right(p));
+			break;
+		default:	/* can't happen */
+			FATAL("can't happen: unknown type %d in freetr", type(p));
+			break;
+		}
+		xfree(p);
+	}
+}
+
+static Ccl *ccldup(const Ccl *cp)	/* a copy of cp, to be freed apart */
+{
+	size_t n = sizeof(Ccl) + 2 * cp->nrange * sizeof(int);
+	Ccl *np;
+
+	if ((np = (Ccl *) malloc(n)) == NULL)
+		overflo(__func__);
+	memcpy(np, cp, n);
+	np->range = (int *) (np + 1);
+	return np;
+}
+
+static Node *dupnode(Node *p)	/* a copy of node p, sharing its operands */
+{
+	if (type(p) == REPEAT)
+		return op3(REPEAT, left(p), right(p), p->narg[2]);
+	return op2(type(p), left(p), right(p));
+}
+
+static Node *dupre(Node *p)	/* a copy of parse tree p, for a repetition */
+{
+	static Walk w;	/* each original node, then its copy */
+	Node *r, *q;
+	int i;
+
+	r = dupnode(p);
+	push(&w, p);
+	push(&w, r);
+	while (w.n > 0) {
+		q = w.node[--w.n];
+		p = w.node[--w.n];
+		switch (type(p)) {
+		ELEAF
+		LEAF
+			if (type(p) == CCL || type(p) == NCCL)
+				q->narg[1] = (Node *) ccldup((Ccl *) right(p));
+			break;
+		case REPEAT:	/* its bounds are not nodes */
+			q->narg[0] = dupnode(left(p));
+			push(&w, left(p));
+			push(&w, q->narg[0]);
+			break;
+		UNARY
+		case ZERO:
+		case CAT:
+		case OR:
+			for (i = 0; i < 2 && p->narg[i] != NIL; i++) {
+				q->narg[i] = dupnode(p->narg[i]);
+				push(&w, p->narg[i]);
+				push(&w, q->narg[i]);
+			}
+			break;
+		default:	/* can't happen */
+			FATAL("can't happen: unknown type %d in dupre", type(p));
+			break;
+		}
+	}
+	return r;
+}
+
+/* in the parsing of regular expressions, metacharacters like . have */
+/* to be seen literally;  \056 is not a metacharacter. */
+
+int hexstr(const uschar **pp, int max)	/* find and eval hex string at pp, return new p */
+{			/* only pick up one 8-bit byte (2 chars) */
+	const uschar *p;
+	int n = 0;
+	int i;
+
+	for (i = 0, p = *pp; i < max && isxdigit(*p); i++, p++) {
+		if (isdigit((int) *p))
+			n = 16 * n + *p - '0';
+		else if (*p >= 'a' && *p <= 'f')
+			n = 16 * n + *p - 'a' + 10;
+		else if (*p >= 'A' && *p <= 'F')
+			n = 16 * n + *p - 'A' + 10;
+	}
+	*pp = p;
+	return n;
+}
 
 
 
@@ -416,67 +1211,85 @@ int quoted(const uschar **pp)	/* pick up next thing after a \\ */
 	return c;
 }
 
-int *cclenter(const char *argp)	/* add a character class */
+/*
+ * A character class is kept as a bitmap of its runes below 256 and
+ * a sorted table of ranges for the rest, so member is a bit test or
+ * a binary search however big the class is.  NUL is never in one:
+ * to the dfa it is the end of the string.
+ */
+
+static int byrange(const void *a, const void *b)	/* for qsort */
 {
-	int i, c, c2;
-	int n;
+	return *(const int *) a - *(const int *) b;
+}
+
+Ccl *cclenter(const char *argp)	/* add a character class */
+{
+	int i, n, c, c2, nr, nw;
 	const uschar *p = (const uschar *) argp;
-	int *bp, *retp;
-	static int *buf = NULL;
-	static int bufsz = 100;
+	static int *buf = NULL;	/* lo, hi pairs as they come */
+	static int bufsz = 0;
+	Ccl *cp;
 
-	if (buf == NULL && (buf = (int *) calloc(bufsz, sizeof(int))) == NULL)
-		FATAL("out of space for character class [%.10s...] 1", p);
-	bp = buf;
-	for (i = 0; *p != 0; ) {
+	for (nr = 0; *p != 0; ) {
 		n = u8_rune(&c, (const char *) p);
 		p += n;
 		if (c == '\\') {
 			c = quoted(&p);
-		} else if (c == '-' && i > 0 && bp[-1] != 0) {
+		} else if (c == '-' && nr > 0 && buf[2*nr-1] != 0) {
 			if (*p != 0) {
-				c = bp[-1];
-				/* c2 = *p++; */
+				c = buf[2*nr-1];
 				n = u8_rune(&c2, (const char *) p);
 				p += n;
 				if (c2 == '\\')
 					c2 = quoted(&p); /* BUG: sets p, has to be u8 size */
-				if (c > c2) {	/* empty; ignore */
-					bp--;
-					i--;
+				if (c > c2) {	/* empty; ignore, with the one before */
+					if (--buf[2*nr-1] < buf[2*nr-2])
+						nr--;
 					continue;
 				}
-				while (c < c2) {
-					if (i >= bufsz) {
-						bufsz *= 2;
-						buf = (int *) realloc(buf, bufsz * sizeof(int));
-						if (buf == NULL)
-							FATAL("out of space for character class [%.10s...] 2", p);
-						bp = buf + i;
-					}
-					*bp++ = ++c;
-					i++;
-				}
+				buf[2*nr-1] = c2;
 				continue;
 			}
 		}
-		if (i >= bufsz) {
-			bufsz *= 2;
+		if (2 * nr + 2 > bufsz) {
+			bufsz = bufsz > 0 ? 2 * bufsz : 64;
 			buf = (int *) realloc(buf, bufsz * sizeof(int));
 			if (buf == NULL)
 				FATAL("out of space for character class [%.10s...] 2", p);
-			bp = buf + i;
 		}
-		*bp++ = c;
-		i++;
+		buf[2*nr] = buf[2*nr+1] = c;
+		nr++;
 	}
-	*bp = 0;
-	/* DPRINTF("cclenter: in = |%s|, out = |%s|\n", op, buf); BUG: can't print array of int */
-	/* xfree(op);  BUG: what are we freeing here? */
-	retp = (int *) calloc(bp-buf+1, sizeof(int));
-	for (i = 0; i < bp-buf+1; i++)
-		retp[i] = buf[i];
-	return retp;
+	for (i = nw = 0; i < nr; i++)
+		if (buf[2*i+1] >= 256)
+			nw++;
+	cp = (Ccl *) calloc(1, sizeof(Ccl) + 2 * nw * sizeof(int));
+	if (cp == NULL)
+		overflo(__func__);
+	cp->range = (int *) (cp + 1);
+	for (i = nw = 0; i < nr; i++) {
+		for (c = buf[2*i] < 1 ? 1 : buf[2*i]; c <= buf[2*i+1] && c < 256; c++)
+			cp->bits[c >> 5] |= 1u << (c & 31);
+		if (buf[2*i+1] >= 256) {	/* the part from 256 on */
+			cp->range[2*nw] = c;
+			cp->range[2*nw+1] = buf[2*i+1];
+			nw++;
+		}
+	}
+	qsort(cp->range, nw, 2 * sizeof(int), byrange);
+	for (i = 0; i < nw; i++) {	/* merge those that overlap or touch */
+		n = cp->nrange;
+		if (n > 0 && cp->range[2*i] <= cp->range[2*n-1] + 1) {
+			if (cp->range[2*i+1] > cp->range[2*n-1])
+				cp->range[2*n-1] = cp->range[2*i+1];
+			continue;
+		}
+		cp->range[2*n] = cp->range[2*i];
+		cp->range[2*n+1] = cp->range[2*i+1];
+		cp->nrange++;
+	}
+	return cp;
 }
 
 void overflo(const char *s)
@@ -484,141 +1297,212 @@ void overflo(const char *s)
 	FATAL("regular expression too big: out of space in %.30s...", s);
 }
 
-void cfoll(fa *f, Node *v)	/* enter follow set of each leaf of vertex v into lfollow[leaf] */
-{
-	int i;
-	int *p;
+/*
+ * The follow sets of the leaves are worked out from the top down.
+ * What can follow a node is what can follow its parent, or for the
+ * left side of a concatenation what the right side can start with,
+ * and for a loop what it can start again with, as well; so most nodes
+ * share their parent's set.  The sets are sorted, largest first, as
+ * states are, and come out of one arena per fa, freed with it.
+ */
 
-	switch (type(v)) {
-	ELEAF
-	LEAF
-		f->re[info(v)].ltype = type(v);
-		f->re[info(v)].lval.np = right(v);
-		while (f->accept >= maxsetvec) {	/* guessing here! */
-			resizesetvec(__func__);
-		}
-		for (i = 0; i <= f->accept; i++)
-			setvec[i] = 0;
-		setcnt = 0;
-		follow(v);	/* computes setvec and setcnt */
-		p = intalloc(setcnt + 1, __func__);
-		f->re[info(v)].lfollow = p;
-		*p = setcnt;
-		for (i = f->accept; i >= 0; i--)
-			if (setvec[i] == 1)
-				*++p = i;
-		break;
-	UNARY
-		cfoll(f,left(v));
-		break;
-	case CAT:
-	case OR:
-		cfoll(f,left(v));
-		cfoll(f,right(v));
-		break;
-	case ZERO:
-		break;
-	default:	/* can't happen */
-		FATAL("can't happen: unknown type %d in cfoll", type(v));
+typedef struct Arena {
+	struct	Arena *next;
+	size_t	size;
+	size_t	used;
+	int	v[1];	/* variable: actual size set by calling malloc */
+} Arena;
+
+#define	ARENAMIN	1024	/* ints in the smallest piece of an arena */
+
+static int *arenalloc(fa *f, size_t n)	/* n ints from f's arena */
+{
+	Arena *a = f->arena;
+	size_t m;
+
+	if (a == NULL || a->size - a->used < n) {
+		m = a != NULL ? 2 * a->size : ARENAMIN;
+		if (m < n)
+			m = n;
+		a = (Arena *) malloc(sizeof(Arena) + (m - 1) * sizeof(int));
+		if (a == NULL)
+			overflo(__func__);
+		a->next = f->arena;
+		a->size = m;
+		a->used = 0;
+		f->arena = a;
 	}
+	a->used += n;
+	return a->v + a->used - n;
 }
 
-int first(Node *p)	/* collects initially active leaves of p into setvec */
-			/* returns 0 if p matches empty string */
+static void addpos(int i)	/* add position i to tmpset; see cgoto */
 {
-	int b, lp;
+	int m = setvec[i];
 
-	switch (type(p)) {
-	ELEAF
-	LEAF
-		lp = info(p);	/* look for high-water mark of subscripts */
-		while (setcnt >= maxsetvec || lp >= maxsetvec) {	/* guessing here! */
-			resizesetvec(__func__);
-		}
-		if (type(p) == EMPTYRE) {
-			setvec[lp] = 0;
-			return(0);
-		}
-		if (setvec[lp] != 1) {
-			setvec[lp] = 1;
-			setcnt++;
-		}
-		if (type(p) == CCL && (*(int *) right(p)) == 0)
-			return(0);		/* empty CCL */
-		return(1);
-	case PLUS:
-		if (first(left(p)) == 0)
-			return(0);
-		return(1);
-	case STAR:
-	case QUEST:
-		first(left(p));
-		return(0);
-	case CAT:
-		if (first(left(p)) == 0 && first(right(p)) == 0) return(0);
-		return(1);
-	case OR:
-		b = first(right(p));
-		if (first(left(p)) == 0 || b == 0) return(0);
-		return(1);
-	case ZERO:
-		return 0;
+	if (m < 1 || m > setcnt || tmpset[m] != i) {
+		tmpset[++setcnt] = i;
+		setvec[i] = setcnt;
 	}
-	FATAL("can't happen: unknown type %d in first", type(p));	/* can't happen */
-	return(-1);
 }
 
-void follow(Node *v)	/* collects leaves that can follow v into setvec */
+static int *folset(fa *f, Node *p, int *set)	/* first(p) and set, in f's arena */
 {
-	Node *p;
+	int i, *q;
 
-	if (type(v) == FINAL)
-		return;
-	p = parent(v);
-	switch (type(p)) {
-	case STAR:
-	case PLUS:
-		first(v);
-		follow(p);
-		return;
+	setcnt = 0;
+	first(p);
+	if (set != NULL) {
+		if (setcnt == 0)
+			return set;
+		for (i = 1; i <= set[0]; i++)
+			addpos(set[i]);
+		if (setcnt == set[0])	/* nothing new */
+			return set;
+	}
+	qsort(tmpset + 1, setcnt, sizeof(*tmpset), bydesc);
+	q = arenalloc(f, setcnt + 1);
+	q[0] = setcnt;
+	memcpy(q + 1, tmpset + 1, setcnt * sizeof(int));
+	return q;
+}
 
-	case OR:
-	case QUEST:
-		follow(p);
-		return;
+static void setfol(fa *f, Node *p, int *set)	/* what can follow p is set */
+{
+	if (!isleaf(p))
+		fol[info(p)] = set;
+	else if (type(p) == FINAL)
+		f->re[info(p)].lfollow = arenalloc(f, 1);	/* nothing; 0 */
+	else
+		f->re[info(p)].lfollow = set;
+}
 
-	case CAT:
-		if (v == left(p)) {	/* v is left child of p */
-			if (first(right(p)) == 0) {
-				follow(p);
-				return;
-			}
-		} else		/* v is right child */
-			follow(p);
-		return;
+void cfoll(fa *f, Node *v)	/* enter follow set of each leaf of vertex v into lfollow[leaf] */
+{
+	int i, *set;
+	Node *p;
+
+	while (f->accept + 1 >= maxsetvec) {	/* guessing here! */
+		resizesetvec(__func__);
+	}
+	setfol(f, v, arenalloc(f, 1));	/* nothing follows the whole */
+	for (i = 0; i < tree.n; i++) {	/* parents first */
+		p = tree.node[i];
+		if (isleaf(p)) {
+			f->re[info(p)].ltype = type(p);
+			f->re[info(p)].lval.np = right(p);
+			continue;
+		}
+		set = fol[i];
+		switch (type(p)) {
+		case STAR:
+		case PLUS:
+			setfol(f, left(p), folset(f, left(p), set));
+			break;
+		case QUEST:
+			setfol(f, left(p), set);
+			break;
+		case REPEAT:	/* a counter; see cntstep */
+			setfol(f, left(p), set);
+			if (ptoi(p->narg[2]) > INT_MAX / 4 / (f->accept + 1))
+				overflo(__func__);
+			f->re[info(left(p))].lmin = ptoi(right(p));
+			f->re[info(left(p))].lmax = ptoi(p->narg[2]);
+			break;
+		case OR:
+			setfol(f, left(p), set);
+			setfol(f, right(p), set);
+			break;
+		case CAT:
+			setfol(f, left(p), folset(f, right(p), isnul(right(p)) ? set : NULL));
+			setfol(f, right(p), set);
+			break;
+		}
 	}
 }
 
-int member(int c, int *sarg)	/* is c in s? */
+int first(Node *p)	/* adds initially active leaves of p to tmpset */
+			/* returns 0 if p matches empty string */
 {
-	int *s = (int *) sarg;
+	static Walk w;
+	Node *q;
+
+	push(&w, p);
+	while (w.n > 0) {
+		q = w.node[--w.n];
+		switch (type(q)) {
+		ELEAF
+			break;
+		LEAF
+			addpos(info(q));
+			break;
+		UNARY
+		case REPEAT:
+			push(&w, left(q));
+			break;
+		case CAT:
+			push(&w, left(q));
+			if (isnul(left(q)))
+				push(&w, right(q));
+			break;
+		case OR:
+			push(&w, left(q));
+			push(&w, right(q));
+			break;
+		case ZERO:
+			break;
+		default:	/* can't happen */
+			FATAL("can't happen: unknown type %d in first", type(q));
+		}
+	}
+	return !isnul(p);
+}
 
-	while (*s)
-		if (c == *s++)
+int member(int c, const Ccl *cp)	/* is c in cp? */
+{
+	int lo, hi, m;
+
+	if ((unsigned) c < 256)
+		return (cp->bits[c >> 5] >> (c & 31)) & 1;
+	for (lo = 0, hi = cp->nrange - 1; lo <= hi; ) {
+		m = (lo + hi) / 2;
+		if (c < cp->range[2*m])
+			hi = m - 1;
+		else if (c > cp->range[2*m+1])
+			lo = m + 1;
+		else
 			return(1);
+	}
 	return(0);
 }
 
+static int cclsole(const Ccl *cp)	/* the one rune in cp; 0 if none, -1 if more */
+{
+	int i, c = 0;
+
+	for (i = 1; i < 256; i++)
+		if (member(i, cp)) {
+			if (c != 0)
+				return -1;
+			c = i;
+		}
+	if (cp->nrange == 0)
+		return c;
+	if (c != 0 || cp->nrange > 1 || cp->range[0] != cp->range[1])
+		return -1;
+	return cp->range[0];
+}
+
 static void resize_gototab(fa *f, int state)
 {
-	size_t new_size = f->gototab[state].allocated * 2;
+	size_t orig_size = f->gototab[state].allocated;
+	size_t new_size = orig_size > 0 ? orig_size * 2 : 4;
 	gtte *p = (gtte *) realloc(f->gototab[state].entries, new_size * sizeof(gtte));
 	if (p == NULL)
 		overflo(__func__);
 
 	// need to initialize the new memory to zero
-	size_t orig_size = f->gototab[state].allocated;		// 2nd half of new mem is this size
-	memset(p + orig_size, 0, orig_size * sizeof(gtte));	// clean it out
+	memset(p + orig_size, 0, (new_size - orig_size) * sizeof(gtte));
 
 	f->gototab[state].allocated = new_size;			// update gototab info
 	f->gototab[state].entries = p;
@@ -629,6 +1513,10 @@ static int get_gototab(fa *f, int state, int ch) /* hide gototab implementation
 	gtte key;
 	gtte *item;
 
+	if (onebyte(ch))
+		return f->trans[state * f->nclass + f->cls[ch]];
+	if (f->gototab[state].inuse == 0)
+		return 0;
 	key.ch = ch;
 	key.state = 0;	/* irrelevant */
 	item = (gtte *) bsearch(& key, f->gototab[state].entries,
@@ -653,6 +1541,10 @@ static int entry_cmp(const void *l, const void *r)
 
 static int set_gototab(fa *f, int state, int ch, int val) /* hide gototab implementation */
 {
+	if (onebyte(ch))
+		return f->trans[state * f->nclass + f->cls[ch]] = val;
+	if (f->gototab[state].allocated == 0)
+		resize_gototab(f, state);
 	if (f->gototab[state].inuse == 0) {
 		f->gototab[state].entries[0].ch = ch;
 		f->gototab[state].entries[0].state = val;
@@ -702,262 +1594,1054 @@ static int set_gototab(fa *f, int state, int ch, int val) /* hide gototab implem
 
 static void clear_gototab(fa *f, int state)
 {
-	memset(f->gototab[state].entries, 0,
-		f->gototab[state].allocated * sizeof(gtte));
+	if (f->gototab[state].allocated > 0)
+		memset(f->gototab[state].entries, 0,
+			f->gototab[state].allocated * sizeof(gtte));
 	f->gototab[state].inuse = 0;
+	memset(f->trans + state * f->nclass, 0, f->nclass * sizeof(int));
+	f->loop[state] = 0;
+}
+
+/*
+ * States are made as the input needs them, so a regular expression
+ * with a great many of them, or a long run of input that keeps
+ * finding new ones, could use any amount of memory.  Once an fa has
+ * maxstat states it is flushed, as in RE2: the states past nbase
+ * are thrown away, along with every transition, and made again if
+ * they turn up again.  Their numbers are used over.  The state the
+ * caller is working from is kept, as are the ones llmatch has threads
+ * in; the callers otherwise hold nothing but the first few states
+ * between bgoto's.  If flushing keeps finding that hardly any state
+ * was used more than once, the transitions aren't worth keeping at
+ * all: the fa stops remembering them and just works out each next
+ * set of positions from the last one.
+ */
+
+static int *pinned;		/* states flushdfa must keep, for llmatch */
+static int npinned;
+
+static int flushdfa(fa *f, int keep)	/* flush f; return number freed */
+{
+	bool *kept;
+	int i, n = 0;
+
+	if ((kept = (bool *) calloc(f->curstat + 1, sizeof(*kept))) == NULL)
+		overflo(__func__);
+	kept[keep] = true;
+	for (i = 0; i < npinned; i++)
+		kept[pinned[i]] = true;
+	for (i = f->nbase + 1; i <= f->curstat; i++)
+		if (f->posns[i] != NULL && !kept[i]) {
+			xfree(f->posns[i]);
+			n++;
+		}
+	free(kept);
+	for (i = 0; i < f->state_count; i++) {
+		xfree(f->gototab[i].entries);
+		f->gototab[i].allocated = 0;
+		f->gototab[i].inuse = 0;
+	}
+	memset(f->trans, 0, f->state_count * f->nclass * sizeof(int));
+	remakestab(f);
+	f->freeat = f->nbase + 1;
+	f->nflush++;
+	DPRINTF("fa /%s/: flush %d freed %d of %d states, %ld transitions made\n",
+		f->restr, f->nflush, n, f->curstat + 1, f->ncomputed);
+	if (20 * f->nmade >= 19 * f->ncomputed)	/* next to no set came back */
+		f->nthrash++;
+	else
+		f->nthrash = 0;
+	if (f->nthrash >= 3 && !f->nocache) {
+		f->nocache = true;
+		DPRINTF("fa /%s/: thrashing, transitions no longer kept\n", f->restr);
+	}
+	f->nmade = f->ncomputed = 0;
+	if (n < f->maxstat / 4) {	/* too many are kept to be worth it */
+		f->maxstat *= 2;
+		DPRINTF("fa /%s/: limit raised to %d states\n", f->restr, f->maxstat);
+	}
+	return n;
+}
+
+static int newstate(fa *f, int keep)	/* number for a new state after keep */
+{
+	int i;
+
+	for (;;) {
+		while (f->freeat <= f->curstat && f->posns[f->freeat] != NULL)
+			f->freeat++;
+		if (f->freeat <= f->curstat)	/* one that was flushed */
+			break;
+		if (f->curstat + 1 < f->maxstat || flushdfa(f, keep) == 0) {
+			f->freeat = ++(f->curstat);
+			break;
+		}
+	}
+	i = f->freeat++;
+	resize_state(f, i);
+	clear_gototab(f, i);
+	return i;
+}
+
+/*
+ * A state part way through a utf-8 character has posns
+ * {-1, from, k, b1..bk}: state from has seen the k bytes b1..bk of
+ * a character and needs more.  The -1 keeps cgoto from taking it
+ * for a set of positions.
+ */
+
+static int partstate(fa *f, int from, const int *b, int k)
+{
+	int i, s, *p;
+
+	s = newstate(f, from);
+	p = intalloc(k + 3, __func__);
+	p[0] = -1;
+	p[1] = from;
+	p[2] = k;
+	for (i = 0; i < k; i++)
+		p[3+i] = b[i];
+	f->posns[s] = p;
+	f->out[s] = 0;
+	return s;
+}
+
+static int runegoto(fa *f, int s, int c)	/* next state from s on rune c */
+{
+	int ns;
+
+	if ((ns = get_gototab(f, s, c)) != 0)
+		return ns;
+	return cgoto(f, s, c);
+}
+
+/*
+ * bgoto found no next state for byte c in state s: work it out and
+ * remember it.  *n is set to 1, the byte is used up, except when
+ * s was part way through a character that c does not continue:
+ * then the first byte of it is taken as a character on its own,
+ * as u8_rune would, and *n is set to move the input to the byte
+ * after that one.  That case isn't remembered in the table.
+ */
+
+static int bytestep(fa *f, int s, int c, int *n)
+{
+	int b[4], i, k, ns, r;
+	char u[4];
+	int *p = f->posns[s];
+	int nflush = f->nflush;
+
+	*n = 1;
+	if (p[0] >= 0) {	/* s is a set of positions */
+		if (seqlen(c) == 1)
+			ns = runegoto(f, s, c);
+		else
+			ns = partstate(f, s, &c, 1);
+	} else if ((c & 0xC0) == 0x80) {	/* continues the character */
+		k = p[2];
+		for (i = 0; i < k; i++)
+			b[i] = p[3+i];
+		b[k++] = c;
+		if (k < seqlen(b[0]))
+			ns = partstate(f, p[1], b, k);
+		else {
+			for (i = 0; i < k; i++)
+				u[i] = b[i];
+			u8_runen(&r, u, k);
+			ns = runegoto(f, p[1], r);
+		}
+	} else {	/* not utf-8 after all */
+		*n = 1 - p[2];
+		return runegoto(f, p[1], p[3]);
+	}
+	if (f->nflush == nflush	/* else s may be gone */
+	  && (!f->nocache || f->posns[ns][0] < 0))
+		f->trans[s * f->nclass + f->cls[c]] = ns;
+	return ns;
+}
+
+/*
+ * A string with no operators in it only ever matches itself, so FS
+ * and split() look for it with strstr instead of running the dfa.
+ * With utf-8, it must not have characters 128 to 255 or stray bytes
+ * in it: the dfa would also match those as bytes on their own.
+ */
+
+int relit(const char *s)	/* strlen(s) if s is a plain string, else 0 */
+{
+	const char *p;
+	int c;
+
+	for (p = s; *p != '\0'; p++) {
+		if (strchr("\\^$.[]|()*+?{}", *p) != NULL)
+			return 0;
+		if ((uschar) *p >= 128 && awk_mb_cur_max > 1) {
+			p += u8_rune(&c, p) - 1;
+			if (c < 256)
+				return 0;
+		}
+	}
+	return p - s;
+}
+
+static int litmatch(fa *f, const char *p)	/* pmatch for a plain string */
+{
+	if ((p = strstr(p, f->must)) == NULL) {
+		patlen = -1;
+		return 0;
+	}
+	patbeg = p;
+	patlen = f->litlen;
+	return 1;
+}
+
+/*
+ * Aho-Corasick.  A regular expression that is nothing but a long
+ * list of plain strings, like (foo|bar|...|baz) with thousands of
+ * them, makes a dfa whose every state holds the first positions of
+ * all of them, so it is slow to build and slow to run.  Such an
+ * expression, possibly between ^ and $, gets a trie of its strings
+ * instead, with a failure link from each node to the longest proper
+ * suffix of its string that is also in the trie, and is matched by
+ * one pass over the text.  Building it takes time and space in
+ * proportion to the total length of the strings.  The fa is then
+ * just a shell for it; fnematch, which works on the dfa, has one
+ * made if it needs it.
+ */
+
+#define	NACMIN	64	/* fewer strings than this are left to the dfa */
+#define	ACHASH(s, c)	((unsigned) (s) * 2654435761u ^ (c))	/* of an edge */
+
+typedef struct Ac {
+	int	nstr;		/* strings in it */
+	int	nnode;		/* node 0 is the root */
+	int	maxnode;
+	int	*fail;		/* failure link of each node */
+	int	*depth;		/* length of its string */
+	int	*term;		/* longest string in the list it ends with, or 0 */
+	int	*kid;		/* its first child and */
+	int	*sib;		/* next sibling, for building */
+	uschar	*byte;		/* the byte that leads to it */
+	int	*enode;		/* open-addressed table of edges: */
+	int	*eto;		/* enode --byte--> eto, 0 if free */
+	int	nedge;		/* edges in it */
+	int	maxedge;	/* its size, a power of 2 */
+	int	root[256];	/* children of the root, 0 if none */
+	bool	bol;		/* strings must start at the beginning, */
+	bool	eol;		/* and end at the end */
+	uschar	cls[256];	/* 0 for bytes in none of the strings */
+	int	nclass;
+	int	*row;		/* transitions of each node worked out so far, */
+	int	*next;		/* nclass of them a row, next node + 1 or 0 */
+	int	nrow;
+	int	maxrow;
+	fa	*dfa;		/* for fnematch */
+} Ac;
+
+static int ackid(Ac *a, int s, int c)	/* child of s on c, or 0 */
+{
+	unsigned i, m = a->maxedge - 1;
+	int t;
+
+	if (s == 0)
+		return a->root[c];
+	if (a->nedge == 0)
+		return 0;
+	for (i = ACHASH(s, c) & m; (t = a->eto[i]) != 0; i = (i + 1) & m)
+		if (a->enode[i] == s && a->byte[t] == c)
+			return t;
+	return 0;
+}
+
+static void acedge(Ac *a, int s, int c, int t)	/* s --c--> t */
+{
+	unsigned i, m;
+	int j, *en, *et, n;
+
+	if (s == 0) {
+		a->root[c] = t;
+		return;
+	}
+	if (2 * (a->nedge + 1) > a->maxedge) {	/* keep it half empty */
+		en = a->enode;
+		et = a->eto;
+		n = a->maxedge;
+		a->maxedge = n > 0 ? 2 * n : 64;
+		a->enode = intalloc(a->maxedge, __func__);
+		a->eto = intalloc(a->maxedge, __func__);
+		m = a->maxedge - 1;
+		for (j = 0; j < n; j++)
+			if (et[j] != 0) {
+				for (i = ACHASH(en[j], a->byte[et[j]]) & m;
+				    a->eto[i] != 0; i = (i + 1) & m)
+					;
+				a->enode[i] = en[j];
+				a->eto[i] = et[j];
+			}
+		free(en);
+		free(et);
+	}
+	m = a->maxedge - 1;
+	for (i = ACHASH(s, c) & m; a->eto[i] != 0; i = (i + 1) & m)
+		;
+	a->enode[i] = s;
+	a->eto[i] = t;
+	a->nedge++;
+}
+
+static int acnode(Ac *a, int from, int c)	/* new child of from on c */
+{
+	int n = a->nnode;
+
+	if (n >= a->maxnode) {
+		a->maxnode = a->maxnode > 0 ? 2 * a->maxnode : 64;
+		a->fail = (int *) realloc(a->fail, a->maxnode * sizeof(int));
+		a->depth = (int *) realloc(a->depth, a->maxnode * sizeof(int));
+		a->term = (int *) realloc(a->term, a->maxnode * sizeof(int));
+		a->kid = (int *) realloc(a->kid, a->maxnode * sizeof(int));
+		a->sib = (int *) realloc(a->sib, a->maxnode * sizeof(int));
+		a->byte = (uschar *) realloc(a->byte, a->maxnode);
+		if (a->fail == NULL || a->depth == NULL || a->term == NULL
+		  || a->kid == NULL || a->sib == NULL || a->byte == NULL)
+			overflo(__func__);
+	}
+	a->nnode++;
+	a->fail[n] = 0;
+	a->depth[n] = from < 0 ? 0 : a->depth[from] + 1;
+	a->term[n] = 0;
+	a->kid[n] = 0;
+	a->byte[n] = c;
+	if (from >= 0) {
+		a->sib[n] = a->kid[from];
+		a->kid[from] = n;
+		acedge(a, from, c, n);
+	} else
+		a->sib[n] = 0;
+	return n;
+}
+
+static void freeac(Ac *a)
+{
+	if (a == NULL)
+		return;
+	free(a->fail);
+	free(a->depth);
+	free(a->term);
+	free(a->kid);
+	free(a->sib);
+	free(a->byte);
+	free(a->enode);
+	free(a->eto);
+	free(a->row);
+	free(a->next);
+	freefa(a->dfa);
+	free(a);
+}
+
+static Ac *mkac(const char *s)	/* trie for s, if s is a list of strings */
+{
+	const uschar *p = (const uschar *) s;
+	bool paren, bol = false, eol = false;
+	int c, i, k, n, t, u, nstr, *queue;
+	char b[8];
+	Ac *a;
+
+	for (nstr = 1, i = 0; s[i] != '\0'; i++)	/* quick check first */
+		if (s[i] == '|')
+			nstr++;
+	if (nstr < NACMIN)
+		return NULL;
+	if (*p == '^') {
+		bol = true;
+		p++;
+	}
+	if ((paren = (*p == '(')))
+		p++;
+	else if (bol)
+		return NULL;	/* ^ would only go with the first */
+	if ((a = (Ac *) calloc(1, sizeof(*a))) == NULL)
+		overflo(__func__);
+	acnode(a, -1, 0);
+	for (t = 0, k = 0; ; ) {	/* t is the node for the string so far */
+		if (*p == '|' || *p == (paren ? ')' : '\0')) {
+			if (t == 0)	/* an empty one */
+				goto no;
+			a->term[t] = a->depth[t];
+			k++;
+			if (*p == '|') {
+				p++;
+				t = 0;
+				continue;
+			}
+			if (paren)
+				p++;
+			break;
+		}
+		if (*p == '\0' || strchr("^$.[]()*+?{}", *p) != NULL)
+			goto no;
+		p += u8_rune(&c, (const char *) p);
+		if (c == '\\')
+			c = quoted(&p);
+		if (onebyte(c) && c != 0) {
+			b[0] = c;
+			n = 1;
+		} else if (awk_mb_cur_max > 1 && c >= 256 && c <= 0x10FFFF)
+			n = runetochar(b, c);
+		else	/* see relit */
+			goto no;
+		for (i = 0; i < n; i++)
+			t = (u = ackid(a, t, (uschar) b[i])) != 0 ? u : acnode(a, t, (uschar) b[i]);
+	}
+	if (paren && *p == '$') {
+		eol = true;
+		p++;
+	}
+	if (*p != '\0')
+		goto no;
+	a->nstr = k;
+	a->bol = bol;
+	a->eol = eol;
+	queue = intalloc(a->nnode, __func__);	/* breadth first: failure links */
+	for (i = 0, n = 0, u = a->kid[0]; u != 0; u = a->sib[u])
+		queue[n++] = u;
+	while (i < n) {
+		t = queue[i++];
+		if (a->term[t] == 0)
+			a->term[t] = a->term[a->fail[t]];
+		for (u = a->kid[t]; u != 0; u = a->sib[u]) {
+			queue[n++] = u;
+			for (k = a->fail[t]; ; k = a->fail[k]) {
+				if ((c = ackid(a, k, a->byte[u])) != 0 || k == 0)
+					break;
+			}
+			a->fail[u] = c;
+		}
+	}
+	free(queue);
+	for (i = 1, a->nclass = 1; i < a->nnode; i++)
+		if (a->cls[a->byte[i]] == 0)
+			a->cls[a->byte[i]] = a->nclass++;
+	a->row = intalloc(a->nnode, __func__);	/* all 0: none yet */
+	DPRINTF("fa /%.30s.../: %d strings in a trie of %d nodes\n", s, a->nstr, a->nnode);
+	return a;
+  no:
+	freeac(a);
+	return NULL;
+}
+
+static int acstep(Ac *a, int s, int c)	/* next node from s on byte c */
+{
+	int k, r, t, u;
+
+	if ((k = a->cls[c]) == 0)
+		return 0;
+	if ((r = a->row[s]) == 0) {	/* rows are numbered from 1 */
+		if (a->nrow >= a->maxrow) {
+			a->maxrow = a->maxrow > 0 ? 2 * a->maxrow : 16;
+			a->next = (int *) realloc(a->next, a->maxrow * a->nclass * sizeof(int));
+			if (a->next == NULL)
+				overflo(__func__);
+		}
+		memset(a->next + a->nrow * a->nclass, 0, a->nclass * sizeof(int));
+		r = a->row[s] = ++a->nrow;
+	}
+	if ((t = a->next[(r-1) * a->nclass + k]) != 0)
+		return t - 1;
+	for (u = s; (t = ackid(a, u, c)) == 0 && u != 0; )
+		u = a->fail[u];
+	a->next[(r-1) * a->nclass + k] = t + 1;
+	return t;
+}
+
+/*
+ * match, pmatch and nematch with a trie.  The strings aren't empty, so
+ * pmatch and nematch are the same.  initstat is only a flag here:
+ * split and the like set it to 2 when p0 isn't the beginning.
+ */
+
+static int acmatch(fa *f, const char *p0, bool longest)
+{
+	Ac *a = f->ac;
+	const uschar *p = (const uschar *) p0, *best = NULL;
+	int s = 0, len = 0;
+
+	patbeg = p0;
+	patlen = -1;
+	if (a->bol || (f->anchor && !longest)) {	/* only at p0 */
+		if (a->bol && f->initstat == 2)
+			return 0;
+		for (; *p != '\0' && (s = ackid(a, s, *p)) != 0; p++)
+			if (a->term[s] == a->depth[s] && (!a->eol || p[1] == '\0')) {
+				if (!longest)
+					return 1;
+				len = a->depth[s];
+			}
+		if (len == 0)
+			return 0;
+		patlen = len;
+		return 1;
+	}
+	for (; *p != '\0'; p++) {
+		if (s == 0 && a->root[*p] == 0) {	/* the usual case */
+			if (best != NULL)
+				break;
+			continue;
+		}
+		s = acstep(a, s, *p);
+		if (best != NULL && p + 1 - a->depth[s] > best)
+			break;	/* none can start sooner */
+		if (a->term[s] == 0 || (a->eol && p[1] != '\0'))
+			continue;
+		if (!longest)
+			return 1;
+		if (best == NULL || p + 1 - a->term[s] < best
+		  || (p + 1 - a->term[s] == best && a->term[s] > len)) {
+			best = p + 1 - a->term[s];
+			len = a->term[s];
+		}
+	}
+	if (best == NULL)
+		return 0;
+	patbeg = (const char *) best;
+	patlen = len;
+	return 1;
+}
+
+static int bgoto(fa *f, int s, int c, int *n)	/* next state from s on byte c */
+{			/* *n is how far that moves the input; see bytestep */
+	int ns;
+
+	if ((ns = f->trans[s * f->nclass + f->cls[c]]) != 0) {
+		*n = 1;
+		return ns;
+	}
+	return bytestep(f, s, c, n);
+}
+
+/*
+ * A state that goes back to itself on all but a few bytes, like the
+ * one inside "[^"]*", would otherwise take a step for each byte of a
+ * long run.  Once a matcher has seen a state go to itself LOOPTRY
+ * times, loopcheck works out all its transitions; if no more than
+ * NESC bytes besides NUL lead anywhere else, it is marked LOOPS and
+ * the matchers skip straight to the next of those bytes.  In a string
+ * that ends in NUL that is strcspn, which the C library does many
+ * bytes at a time; the RS scanner's buffer has an end but no NUL, so
+ * it uses memchrset, which runs lib.c's sepmask kernels over it 64
+ * bytes at a time.  (sepmask reads whole blocks, so it can't be used
+ * where the end is only known by its NUL.)
+ *
+ * With utf-8, bytes above 127 lead to states part way through a
+ * character, so they can only be skipped if every character above
+ * 127, and every byte that isn't part of one, leads back to the
+ * state.  Then a run of them, whole characters or not, also ends
+ * in the state, just as bytestep would have it.  That is so when
+ * each of its positions matches either all of those or none.
+ */
+
+#define	LOOPTRY	8
+#define	LOOPS	254
+#define	NOLOOP	255
+
+static bool loophigh(fa *f, int s)	/* do runes above 127 all keep s? */
+{
+	int i, k, *p = f->posns[s];
+	Ccl *cp;
+
+	for (i = 1; i <= *p; i++) {
+		k = setpos(f, p[i]);
+		switch (f->re[k].ltype) {
+		case CHAR:
+			if (ptoi(f->re[k].lval.np) >= 128)
+				return false;
+			break;
+		case CCL:
+		case NCCL:
+			cp = f->re[k].lval.cp;
+			if (cp->nrange > 0 || cp->bits[4] | cp->bits[5]
+			  | cp->bits[6] | cp->bits[7])
+				return false;
+			break;
+		}
+	}
+	return runegoto(f, s, 0x100) == s;
+}
+
+static void loopcheck(fa *f, int s)	/* mark s LOOPS or NOLOOP */
+{
+	int c, n, top, nesc = 0;
+
+	f->loop[s] = NOLOOP;
+	if (f->nocache || f->posns[s][0] < 0)
+		return;
+	top = 256;
+	if (awk_mb_cur_max > 1) {
+		if (!loophigh(f, s))
+			return;
+		top = 128;
+	}
+	for (c = 1; c < top; c++) {
+		if (bgoto(f, s, c, &n) == s)
+			continue;
+		if (nesc >= NESC)
+			return;
+		f->esc[s][nesc++] = c;
+	}
+	f->esc[s][nesc] = '\0';
+	f->loop[s] = LOOPS;
+}
+
+static bool looping(fa *f, int s)	/* s went to itself: is it LOOPS? */
+{
+	if (f->loop[s] < LOOPTRY && ++f->loop[s] == LOOPTRY)
+		loopcheck(f, s);
+	return f->loop[s] == LOOPS;
+}
+
+static const uschar *loopskip(fa *f, int s, const uschar *p)
+{			/* where the run of bytes keeping s from p ends */
+	return p + strcspn((const char *) p, f->esc[s]);
+}
+
+static const char *loopskipn(fa *f, int s, const char *p, const char *e)
+{		/* the same in p..e, which may have no NUL; at most e */
+	return memchrset(p, e, f->esc[s]);
+}
+
+static const uschar *skipto(fa *f, const uschar *p)	/* first place at or */
+{						/* after p a match could start */
+	if (f->pre != NULL)
+		return (const uschar *) strstr((const char *) p, f->pre);
+	if (f->first != NULL)
+		for (; !f->first[*p]; p++)
+			if (*p == '\0')
+				return NULL;
+	return p;
 }
 
 int match(fa *f, const char *p0)	/* shortest match ? */
 {
-	int s, ns;
-	int n;
-	int rune;
+	int s, ns, c, n;
 	const uschar *p = (const uschar *) p0;
 
 	/* return pmatch(f, p0); does it matter whether longest or shortest? */
 
+	if (f->ac != NULL)
+		return acmatch(f, p0, false);
+	if (f->litlen > 0)
+		return f->anchor ? strncmp(p0, f->must, f->litlen) == 0
+			: strstr(p0, f->must) != NULL;
+	if (f->must != NULL && strstr(p0, f->must) == NULL)
+		return(0);
+	if (!f->anchor && (p = skipto(f, p)) == NULL)
+		return(0);
 	s = f->initstat;
 	assert (s < f->state_count);
 
 	if (f->out[s])
 		return(1);
 	do {
-		/* assert(*p < NCHARS); */
-		n = u8_rune(&rune, (const char *) p);
-		if ((ns = get_gototab(f, s, rune)) != 0)
-			s = ns;
-		else
-			s = cgoto(f, s, rune);
-		if (f->out[s])
+		c = *p;
+		ns = bgoto(f, s, c, &n);
+		if (f->out[ns])
 			return(1);
-		if (*p == 0)
-			break;
 		p += n;
-	} while (1);  /* was *p++ != 0 */
+		if (ns == s && c != 0 && looping(f, s))
+			p = loopskip(f, s, p);
+		s = ns;
+	} while (c != 0 || n != 1);
 	return(0);
 }
 
-int pmatch(fa *f, const char *p0)	/* longest match, for sub */
-{
-	int s, ns;
-	int n;
-	int rune;
-	const uschar *p = (const uschar *) p0;
-	const uschar *q;
+/*
+ * pmatch and nematch find the leftmost longest match.  They run the
+ * dfa from each place a match could start in turn, which is quick
+ * when the dfa soon gets stuck, as it mostly does.  When it doesn't,
+ * as with a.*b on a long line with no b, each start goes over most of
+ * the same text again and the search is quadratic; once they have
+ * gone over it more than a few times, llmatch takes over.  It runs
+ * from all the starts at once, a character at a time; each thread is
+ * the state reached from one start.  Threads in the same state can
+ * only go on the same way, so the one that started later is dropped,
+ * and there are never more threads than states.  Threads are kept in
+ * order of where they started, so once one has matched, the ones
+ * after it can't win and are dropped too.
+ */
 
-	s = f->initstat;
-	assert(s < f->state_count);
+static int *thstate;		/* state of each thread */
+static const uschar **thorig;	/* and where it started */
+static int nthread;
+static unsigned *stamp;		/* stamp[s] == gen if a thread is in state s */
+static int nstamp;
+static unsigned gen;
 
-	patbeg = (const char *)p;
-	patlen = -1;
-	do {
-		q = p;
-		do {
-			if (f->out[s])		/* final state */
-				patlen = q-p;
-			/* assert(*q < NCHARS); */
-			n = u8_rune(&rune, (const char *) q);
-			if ((ns = get_gototab(f, s, rune)) != 0)
-				s = ns;
-			else
-				s = cgoto(f, s, rune);
+static void nextgen(void)
+{
+	if (++gen == 0) {	/* wrapped: forget the old stamps */
+		memset(stamp, 0, nstamp * sizeof(*stamp));
+		gen = 1;
+	}
+}
+
+static bool taken(int s)	/* is there a thread in state s? claim it if not */
+{
+	int n;
 
-			assert(s < f->state_count);
+	if (s >= nstamp) {
+		n = s + NSTATES;
+		stamp = (unsigned *) realloc(stamp, n * sizeof(*stamp));
+		if (stamp == NULL)
+			overflo(__func__);
+		memset(stamp + nstamp, 0, (n - nstamp) * sizeof(*stamp));
+		nstamp = n;
+	}
+	if (stamp[s] == gen)
+		return true;
+	stamp[s] = gen;
+	return false;
+}
 
-			if (s == 1) {	/* no transition */
-				if (patlen >= 0) {
-					patbeg = (const char *) p;
-					return(1);
+static int llmatch(fa *f, const uschar *p0, const uschar *p, bool nonempty)
+{				/* leftmost longest match starting at or after p */
+	const uschar *q, *cand, *best = NULL;
+	int c, i, j, k, n, s, ns, len, nt = 0, bestlen = -1;
+
+	nextgen();
+	cand = skipto(f, p);
+	for (q = p; ; q += len) {
+		if (best == NULL && cand != NULL) {	/* start a thread here? */
+			if (cand < q)
+				cand = skipto(f, q);
+			if (nt == 0 && cand != NULL)
+				q = cand;	/* nothing running: skip ahead */
+			if (cand == q && (*q != 0 || !nonempty)) {
+				s = q == p0 ? f->initstat : 2;
+				if (!taken(s)) {
+					if (nt >= nthread) {
+						nthread = nt + NSTATES;
+						thstate = (int *) realloc(thstate, nthread * sizeof(*thstate));
+						thorig = (const uschar **) realloc(thorig, nthread * sizeof(*thorig));
+						if (thstate == NULL || thorig == NULL)
+							overflo(__func__);
+					}
+					thstate[nt] = s;
+					thorig[nt++] = q;
 				}
-				else
-					goto nextin;	/* no match */
 			}
-			if (*q == 0)
+		}
+		pinned = thstate;	/* don't let flushdfa take them */
+		npinned = nt;
+		if (nt == 0)
+			break;
+		for (i = 0; i < nt; i++)
+			if (f->out[thstate[i]] && (q > thorig[i] || !nonempty)) {
+				best = thorig[i];
+				bestlen = q - best;
+				nt = i + 1;
 				break;
-			q += n;
-		} while (1);
-		q++;  /* was *q++ */
-		if (f->out[s])
-			patlen = q-p-1;	/* don't count $ */
-		if (patlen >= 0) {
-			patbeg = (const char *) p;
-			return(1);
+			}
+		if (nt == 1 && thorig[0] == best) {	/* see how long it gets */
+			for (s = thstate[0]; ; s = ns) {
+				if (f->out[s])
+					bestlen = q - best;
+				c = *q;
+				if ((ns = bgoto(f, s, c, &n)) == 1)
+					break;
+				if (c == 0 && n == 1) {
+					if (f->out[ns])
+						bestlen = q - best;	/* don't count $ */
+					break;
+				}
+				q += n;
+				if (ns == s && looping(f, s))
+					q = loopskip(f, s, q);
+			}
+			break;
 		}
-	nextin:
-		s = 2;
-		if (*p == 0)
+		c = *q;
+		if (c == 0) {	/* only $ is left */
+			for (i = 0; i < nt; i++) {
+				s = bgoto(f, thstate[i], 0, &n);
+				if (f->out[s] && (q > thorig[i] || !nonempty)) {
+					best = thorig[i];
+					bestlen = q - best;	/* don't count $ */
+					break;
+				}
+			}
 			break;
-		n = u8_rune(&rune, (const char *) p);
-		p += n;
-	} while (1); /* was *p++ */
-	return (0);
+		}
+		len = c < 128 ? 1 : u8_nextlen((const char *) q);
+		nextgen();
+		for (i = j = 0; i < nt; i++) {
+			s = thstate[i];
+			if (len > 1)
+				for (k = 0; k < len; k++)
+					s = bgoto(f, s, q[k], &n);
+			else if (seqlen(c) > 1)	/* a lead byte on its own */
+				s = runegoto(f, s, c);
+			else
+				s = bgoto(f, s, c, &n);
+			assert(s < f->state_count);
+			if (s == 1 || taken(s))
+				continue;
+			thstate[j] = s;
+			thorig[j++] = thorig[i];
+		}
+		nt = j;
+	}
+	npinned = 0;
+	if (best == NULL)
+		return (0);
+	patbeg = (const char *) best;
+	patlen = bestlen;
+	return (1);
 }
 
-int nematch(fa *f, const char *p0)	/* non-empty match, for sub */
+static int lmatch(fa *f, const char *p0, bool nonempty)	/* for pmatch, nematch */
 {
-	int s, ns;
-        int n;
-        int rune;
+	int s, ns, c, n;
+	long work = 0;
 	const uschar *p = (const uschar *) p0;
-	const uschar *q;
+	const uschar *q, *far = p;
 
+	patbeg = p0;
+	patlen = -1;
+	if (f->must != NULL && strstr(p0, f->must) == NULL)
+		return (0);
 	s = f->initstat;
 	assert(s < f->state_count);
-
-	patbeg = (const char *)p;
-	patlen = -1;
-	while (*p) {
-		q = p;
+	for (;;) {
+		if ((q = skipto(f, p)) == NULL || (nonempty && *q == '\0'))
+			break;
+		if (q != p) {
+			p = q;
+			s = 2;
+		}
 		do {
-			if (f->out[s])		/* final state */
+			if (f->out[s] && (q > p || !nonempty))	/* final state */
 				patlen = q-p;
-			/* assert(*q < NCHARS); */
-			n = u8_rune(&rune, (const char *) q);
-			if ((ns = get_gototab(f, s, rune)) != 0)
-				s = ns;
-			else
-				s = cgoto(f, s, rune);
-			if (s == 1) {	/* no transition */
-				if (patlen > 0) {
-					patbeg = (const char *) p;
-					return(1);
-				} else
-					goto nnextin;	/* no nonempty match */
-			}
-			if (*q == 0)
+			c = *q;
+			ns = bgoto(f, s, c, &n);
+			assert(ns < f->state_count);
+			if (ns == 1) {	/* no transition */
+				s = 1;
 				break;
+			}
 			q += n;
-		} while (1);
-		q++;
-		if (f->out[s])
+			if (ns == s && c != 0 && looping(f, s))
+				q = loopskip(f, s, q);
+			s = ns;
+		} while (c != 0 || n != 1);
+		if (s != 1 && f->out[s] && (q-1 > p || !nonempty))
 			patlen = q-p-1;	/* don't count $ */
-		if (patlen > 0 ) {
+		if (patlen >= 0) {
 			patbeg = (const char *) p;
-			return(1);
+			return (1);
 		}
-	nnextin:
+		if (*p == 0)
+			break;
+		if (q > far)
+			far = q;
+		work += q - p;
+		p += *p < 128 ? 1 : u8_nextlen((const char *) p);
+		if (work > 4 * (far - (const uschar *) p0) + 256)
+			return llmatch(f, (const uschar *) p0, p, nonempty);
 		s = 2;
-		p++;
 	}
 	return (0);
 }
 
+int pmatch(fa *f, const char *p0)	/* longest match, for sub */
+{
+	if (f->ac != NULL)
+		return acmatch(f, p0, true);
+	if (f->litlen > 0)
+		return litmatch(f, p0);
+	return lmatch(f, p0, false);
+}
+
+int nematch(fa *f, const char *p0)	/* non-empty match, for sub */
+{
+	if (f->ac != NULL)
+		return acmatch(f, p0, true);
+	if (f->litlen > 0)
+		return litmatch(f, p0);
+	return lmatch(f, p0, true);
+}
 
 /*
  * NAME
  *     fnematch
  *
  * DESCRIPTION
- *     A stream-fed version of nematch which transfers characters to a
- *     null-terminated buffer. All characters up to and including the last
- *     character of the matching text or EOF are placed in the buffer. If
- *     a match is found, patbeg and patlen are set appropriately.
+ *     A stream-fed version of nematch, for a regular expression RS.
+ *     The automaton runs over the input buffer itself; only the text
+ *     before the match is copied to the null-terminated buffer.  When
+ *     a possible match runs off the end of the input buffer, what has
+ *     been read is carried over into the buffer, more is read, and the
+ *     automaton goes on from where it stopped, in the state it was in,
+ *     with the origin and the longest match so far kept, so a long
+ *     match is not scanned again for each refill.  If a match is found,
+ *     patbeg is set to the end of the text in the buffer and patlen to
+ *     the length of the match, which has been consumed.
  *
  * RETURN VALUES
  *     false    No match found.
  *     true     Match found.
  */
 
-bool fnematch(fa *pfa, FILE *f, char **pbuf, int *pbufsize, int quantum)
-{
-	char *i, *j, *k, *buf = *pbuf;
-	int bufsize = *pbufsize;
-	int c, n, ns, s;
-
-	s = pfa->initstat;
-	patlen = 0;
-
-	/*
-	 * buf <= i <= j <= k <= buf+bufsize
-	 *
-	 * i: origin of active substring
-	 * j: current character
-	 * k: destination of the next getc
-	 */
-
-	i = j = k = buf;
-
-	do {
-		/*
-		 * Call u8_rune with at least awk_mb_cur_max ahead in
-		 * the buffer until EOF interferes.
-		 */
-		if (k - j < (int)awk_mb_cur_max) {
-			if (k + awk_mb_cur_max > buf + bufsize) {
-				char *obuf = buf;
-				adjbuf((char **) &buf, &bufsize,
-				    bufsize + awk_mb_cur_max,
-				    quantum, 0, "fnematch");
-
-				/* buf resized, maybe moved. update pointers */
-				*pbufsize = bufsize;
-				if (obuf != buf) {
-					i = buf + (i - obuf);
-					j = buf + (j - obuf);
-					k = buf + (k - obuf);
-					*pbuf = buf;
-					if (patlen)
-						patbeg = buf + (patbeg - obuf);
-				}
+typedef struct Rscan {	/* how far rsscan has got, kept over refills */
+	const char *org;	/* origin of the match being tried */
+	const char *at;		/* where the dfa is in it */
+	int	s;		/* and in what state */
+	int	len;		/* longest match from org so far, or 0 */
+} Rscan;
+
+static int rsscan(fa *pfa, Rscan *r, const char *e, bool eof)
+{	/* go on with the leftmost-longest non-empty match in r->org..e: */
+	/* 1 if found at r->org, r->len long; 0 if none before r->org; */
+	/* -1 if more input is needed, with r saying where to go on from */
+	const char *i = r->org, *j = r->at;
+	int c, n, ns, s = r->s, mlen = r->len;
+
+	for (;;) {	/* each origin i */
+		for (;;) {
+			if (j < e)
+				c = (uschar) *j;
+			else if (eof)
+				c = 0;	/* EOF's nullbyte */
+			else
+				goto more;	/* might be cut off */
+			ns = bgoto(pfa, s, c, &n);
+			j += n;
+			if (pfa->out[ns]) {	/* final state */
+				mlen = j - i;
+				if (c == 0 && n == 1)	/* don't count $ */
+					mlen--;
 			}
-			for (n = awk_mb_cur_max ; n > 0; n--) {
-				*k++ = (c = getc(f)) != EOF ? c : 0;
-				if (c == EOF) {
-					if (ferror(f))
-						FATAL("fnematch: getc error");
-					break;
-				}
+			if ((c == 0 && n == 1) || ns == 1)
+				break;
+			if (ns == s && looping(pfa, s)) {
+				j = loopskipn(pfa, s, j, e);
+				if (pfa->out[s])
+					mlen = j - i;
 			}
-		}
-
-		j += u8_rune(&c, j);
-
-		if ((ns = get_gototab(pfa, s, c)) != 0)
 			s = ns;
-		else
-			s = cgoto(pfa, s, c);
-
-		if (pfa->out[s]) {	/* final state */
-			patbeg = i;
-			patlen = j - i;
-			if (c == 0)	/* don't count $ */
-				patlen--;
 		}
-
-		if (c && s != 1)
-			continue;  /* origin i still viable, next j */
-		if (patlen)
-			break;     /* best match found */
-
+		if (mlen) {	/* best match found */
+			r->org = i;
+			r->len = mlen;
+			return 1;
+		}
+		if (i >= e || *i == '\0') {	/* no match */
+			r->org = i;
+			return 0;
+		}
 		/* no match at origin i, next i and start over */
-		i += u8_rune(&c, i);
-		if (c == 0)
-			break;    /* no match */
+		i += (uschar) *i < 128 ? 1 : u8_runen(&c, i, e - i);
 		j = i;
 		s = 2;
-	} while (1);
-
-	if (patlen) {
-		/*
-		 * Under no circumstances is the last character fed to
-		 * the automaton part of the match. It is EOF's nullbyte,
-		 * or it sent the automaton into a state with no further
-		 * transitions available (s==1), or both. Room for a
-		 * terminating nullbyte is guaranteed.
-		 *
-		 * ungetc any chars after the end of matching text
-		 * (except for EOF's nullbyte, if present) and null
-		 * terminate the buffer.
-		 */
-		do
-			if (*--k && ungetc(*k, f) == EOF)
-				FATAL("unable to ungetc '%c'", *k);
-		while (k > patbeg + patlen);
-		*k = '\0';
-		return true;
 	}
-	else
-		return false;
+  more:
+	r->org = i;
+	r->at = j;
+	r->s = s;
+	r->len = mlen;
+	return -1;
+}
+
+static void giveback(Inbuf *ib, const char *p, const char *q, const char *w)
+{	/* unread p..q of buf; w..q is all of the current input buffer */
+	if (p >= w) {
+		ib->pos = ib->end - (q - p);
+		return;
+	}
+	ib->pos = ib->end - (q - w);
+	while (w > p)
+		inbufunget(ib, (uschar) *--w);
+}
+
+bool fnematch(fa *pfa, Inbuf *ib, char **pbuf, int *pbufsize, int quantum)
+{
+	char *buf = *pbuf, *rr = buf;	/* text so far is buf..rr */
+	const char *e, *org;
+	int bufsize = *pbufsize;
+	int s = pfa->initstat, r, n, len = 0;
+	int off = 0, aoff = 0, woff = 0;	/* origin, where the dfa is, */
+	bool eof = false, carried = false;	/* and the input buffer, in buf */
+	Rscan sc;
+
+	if (pfa->ac != NULL) {	/* this needs the dfa after all */
+		if (pfa->ac->dfa == NULL)
+			pfa->ac->dfa = dfaof((const char *) pfa->restr, pfa->anchor);
+		pfa = pfa->ac->dfa;
+		if (s != 2)
+			s = pfa->initstat;
+	}
+
+	for (;;) {
+		if (ib->pos >= ib->end && !eof && !inbuffill(ib)) {
+			if (ib->err)
+				FATAL("fnematch: read error");
+			eof = true;
+		}
+		n = ib->end - ib->pos;
+		if (carried) {	/* keep the whole of it */
+			if (!adjbuf(&buf, &bufsize, 1+n+rr-buf, quantum, &rr, "fnematch"))
+				FATAL("input record `%.30s...' too long", buf);
+			woff = rr - buf;
+			memcpy(rr, ib->pos, n);
+			rr += n;
+			ib->pos = ib->end;
+			sc.org = buf + off;
+			sc.at = buf + aoff;
+			e = rr;
+		} else {	/* look in the input buffer itself */
+			sc.org = sc.at = ib->pos;
+			sc.s = s;
+			sc.len = 0;
+			e = ib->end;
+		}
+		r = rsscan(pfa, &sc, e, eof);
+		org = sc.org;
+		len = sc.len;
+		if (r < 0) {	/* carry it over; go on where it stopped */
+			if (!carried) {
+				if (!adjbuf(&buf, &bufsize, 1+n+rr-buf, quantum, &rr, "fnematch"))
+					FATAL("input record `%.30s...' too long", buf);
+				memcpy(rr, ib->pos, n);
+				off = org - ib->pos;
+				aoff = sc.at - ib->pos;
+				rr += n;
+				ib->pos = ib->end;
+				carried = true;
+			} else {
+				off = org - buf;
+				aoff = sc.at - buf;
+			}
+			continue;
+		}
+		if (!carried) {
+			n = org - ib->pos;
+			if (!adjbuf(&buf, &bufsize, 1+n+rr-buf, quantum, &rr, "fnematch"))
+				FATAL("input record `%.30s...' too long", buf);
+			memcpy(rr, ib->pos, n);
+			rr += n;
+			ib->pos += n + (r ? len : org < e);
+		} else {
+			giveback(ib, org + (r ? len : org < e), e, buf + woff);
+			rr = buf + (org - buf);
+		}
+		break;
+	}
+	*rr = '\0';
+	*pbuf = buf;
+	*pbufsize = bufsize;
+	if (r) {
+		patbeg = rr;
+		patlen = len;
+	}
+	return r != 0;
 }
 
 Node *reparse(const char *p)	/* parses regular expression pointed to by p */
@@ -986,11 +2670,9 @@ Node *regexp(void)	/* top-level parse of reg expr */
 Node *primary(void)
 {
 	Node *np;
-	int savelastatom;
 
 	switch (rtok) {
 	case CHAR:
-		lastatom = starttok;
 		np = op2(CHAR, NIL, itonp(rlxval));
 		rtok = relex();
 		return (unary(np));
@@ -1001,17 +2683,14 @@ Node *primary(void)
 		rtok = relex();
 		return (unary(op2(EMPTYRE, NIL, NIL)));
 	case DOT:
-		lastatom = starttok;
 		rtok = relex();
 		return (unary(op2(DOT, NIL, NIL)));
 	case CCL:
-		np = op2(CCL, NIL, (Node*) cclenter((const char *) rlxstr));
-		lastatom = starttok;
+		np = op2(CCL, NIL, (Node *) rlxccl);
 		rtok = relex();
 		return (unary(np));
 	case NCCL:
-		np = op2(NCCL, NIL, (Node *) cclenter((const char *) rlxstr));
-		lastatom = starttok;
+		np = op2(NCCL, NIL, (Node *) rlxccl);
 		rtok = relex();
 		return (unary(np));
 	case '^':
@@ -1021,8 +2700,6 @@ Node *primary(void)
 		rtok = relex();
 		return (unary(op2(CHAR, NIL, NIL)));
 	case '(':
-		lastatom = starttok;
-		savelastatom = starttok - basestr; /* Retain over recursion */
 		rtok = relex();
 		if (rtok == ')') {	/* special pleading for () */
 			rtok = relex();
@@ -1030,7 +2707,6 @@ Node *primary(void)
 		}
 		np = regexp();
 		if (rtok == ')') {
-			lastatom = basestr + savelastatom; /* Restore */
 			rtok = relex();
 			return (unary(np));
 		}
@@ -1042,46 +2718,120 @@ Node *primary(void)
 	return 0;	/*NOTREACHED*/
 }
 
-Node *concat(Node *np)
+Node *concat(Node *np)	/* loops rather than recursing, for long ones */
 {
-	switch (rtok) {
-	case CHAR: case DOT: case ALL: case CCL: case NCCL: case '$': case '(':
-		return (concat(op2(CAT, np, primary())));
-	case EMPTYRE:
-		rtok = relex();
-		return (concat(op2(CAT, op2(CCL, NIL, (Node *) cclenter("")),
-				primary())));
+	for (;;) {
+		switch (rtok) {
+		case CHAR: case DOT: case ALL: case CCL: case NCCL: case '$': case '(':
+			np = op2(CAT, np, primary());
+			continue;
+		case EMPTYRE:
+			rtok = relex();
+			np = op2(CAT, op2(CCL, NIL, (Node *) cclenter("")),
+				primary());
+			continue;
+		}
+		return (np);
 	}
-	return (np);
 }
 
 Node *alt(Node *np)
 {
-	if (rtok == OR) {
+	while (rtok == OR) {
 		rtok = relex();
-		return (alt(op2(OR, np, concat(primary()))));
+		np = op2(OR, np, concat(primary()));
 	}
 	return (np);
 }
 
 Node *unary(Node *np)
 {
-	switch (rtok) {
-	case STAR:
-		rtok = relex();
-		return (unary(op2(STAR, np, NIL)));
-	case PLUS:
-		rtok = relex();
-		return (unary(op2(PLUS, np, NIL)));
-	case QUEST:
-		rtok = relex();
-		return (unary(op2(QUEST, np, NIL)));
-	case ZERO:
-		rtok = relex();
-		return (unary(op2(ZERO, np, NIL)));
-	default:
-		return (np);
+	int n, m;
+
+	for (;;) {
+		switch (rtok) {
+		case STAR:
+			rtok = relex();
+			np = op2(STAR, np, NIL);
+			continue;
+		case PLUS:
+			rtok = relex();
+			np = op2(PLUS, np, NIL);
+			continue;
+		case QUEST:
+			rtok = relex();
+			np = op2(QUEST, np, NIL);
+			continue;
+		case ZERO:
+			rtok = relex();
+			np = op2(ZERO, np, NIL);
+			continue;
+		case REPEAT:
+			n = rlxmin;
+			m = rlxmax;
+			rtok = relex();
+			np = repeat(np, n, m);
+			continue;
+		default:
+			return (np);
+		}
+	}
+}
+
+/*
+ * np{n,m}, or np{n,} if m < 0, becomes copies of the tree np, built
+ * from the right so np itself is the last of them: n-1 copies and np+
+ * for {n,}, or n copies and then the optional ones nested, x{2,5} as
+ * xx(x(x(x)?)?)?.  Nesting them means each optional x can be followed
+ * only by the next one or what comes after, not by all the others, so
+ * the follow sets stay the size of the tree, not its square.  A single
+ * character or class repeated CNTMIN times or more is not copied but
+ * counted: it is one REPEAT node, x{0,m} is x{1,m}? and x{n,} is
+ * x{n}x*.  See cntstep.
+ */
+
+#define	CNTMIN	16	/* fewer copies than this are cheaper */
+
+static bool countable(Node *np)	/* can np{n,m} be counted? */
+{
+	switch (type(np)) {
+	case CHAR:	/* but not ^ or $ */
+		return ptoi(right(np)) != HAT && ptoi(right(np)) != 0;
+	case CCL:	/* but not () */
+		return cclsole((Ccl *) right(np)) != 0;
+	case NCCL:
+	case DOT:
+		return true;
+	}
+	return false;
+}
+
+static Node *repeat(Node *np, int n, int m)
+{
+	Node *p;
+	int i;
+
+	if ((m >= CNTMIN || (m < 0 && n >= CNTMIN)) && countable(np)) {
+		if (m < 0)
+			return op2(CAT, op3(REPEAT, np, itonp(n), itonp(n)),
+				op2(STAR, dupre(np), NIL));
+		p = op3(REPEAT, np, itonp(n > 0 ? n : 1), itonp(m));
+		return n > 0 ? p : op2(QUEST, p, NIL);
+	}
+	if (m < 0) {
+		p = op2(PLUS, np, NIL);
+		n--;
+	} else if (m > n) {
+		p = op2(QUEST, np, NIL);
+		for (i = n + 1; i < m; i++)
+			p = op2(QUEST, op2(CAT, dupre(np), p), NIL);
+	} else {
+		p = np;
+		n--;
 	}
+	for (i = 0; i < n; i++)
+		p = op2(CAT, dupre(np), p);
+	return p;
 }
 
 /*
@@ -1138,116 +2888,6 @@ static const struct charclass {
 	{ NULL,		0,	NULL },
 };
 
-#define REPEAT_SIMPLE		0
-#define REPEAT_PLUS_APPENDED	1
-#define REPEAT_WITH_Q		2
-#define REPEAT_ZERO		3
-
-static int
-replace_repeat(const uschar *reptok, int reptoklen, const uschar *atom,
-	       int atomlen, int firstnum, int secondnum, int special_case)
-{
-	int i, j;
-	uschar *buf = 0;
-	int ret = 1;
-	int init_q = (firstnum == 0);		/* first added char will be ? */
-	int n_q_reps = secondnum-firstnum;	/* m>n, so reduce until {1,m-n} left  */
-	int prefix_length = reptok - basestr;	/* prefix includes first rep	*/
-	int suffix_length = strlen((const char *) reptok) - reptoklen;	/* string after rep specifier	*/
-	int size = prefix_length +  suffix_length;
-
-	if (firstnum > 1) {	/* add room for reps 2 through firstnum */
-		size += atomlen*(firstnum-1);
-	}
-
-	/* Adjust size of buffer for special cases */
-	if (special_case == REPEAT_PLUS_APPENDED) {
-		size++;		/* for the final + */
-	} else if (special_case == REPEAT_WITH_Q) {
-		size += init_q + (atomlen+1)* (n_q_reps-init_q);
-	} else if (special_case == REPEAT_ZERO) {
-		size += 2;	/* just a null ERE: () */
-	}
-	if ((buf = (uschar *) malloc(size + 1)) == NULL)
-		FATAL("out of space in reg expr %.10s..", lastre);
-	memcpy(buf, basestr, prefix_length);	/* copy prefix	*/
-	j = prefix_length;
-	if (special_case == REPEAT_ZERO) {
-		j -= atomlen;
-		buf[j++] = '(';
-		buf[j++] = ')';
-	}
-	for (i = 1; i < firstnum; i++) {	/* copy x reps 	*/
-		memcpy(&buf[j], atom, atomlen);
-		j += atomlen;
-	}
-	if (special_case == REPEAT_PLUS_APPENDED) {
-		buf[j++] = '+';
-	} else if (special_case == REPEAT_WITH_Q) {
-		if (init_q)
-			buf[j++] = '?';
-		for (i = init_q; i < n_q_reps; i++) {	/* copy x? reps */
-			memcpy(&buf[j], atom, atomlen);
-			j += atomlen;
-			buf[j++] = '?';
-		}
-	}
-	memcpy(&buf[j], reptok+reptoklen, suffix_length);
-	j += suffix_length;
-	buf[j] = '\0';
-	/* free old basestr */
-	if (firstbasestr != basestr) {
-		if (basestr)
-			xfree(basestr);
-	}
-	basestr = buf;
-	prestr  = buf + prefix_length;
-	if (special_case == REPEAT_ZERO) {
-		prestr  -= atomlen;
-		ret++;
-	}
-	return ret;
-}
-
-static int repeat(const uschar *reptok, int reptoklen, const uschar *atom,
-		  int atomlen, int firstnum, int secondnum)
-{
-	/*
-	   In general, the repetition specifier or "bound" is replaced here
-	   by an equivalent ERE string, repeating the immediately previous atom
-	   and appending ? and + as needed. Note that the first copy of the
-	   atom is left in place, except in the special_case of a zero-repeat
-	   (i.e., {0}).
-	 */
-	if (secondnum < 0) {	/* means {n,} -> repeat n-1 times followed by PLUS */
-		if (firstnum < 2) {
-			/* 0 or 1: should be handled before you get here */
-			FATAL("internal error");
-		} else {
-			return replace_repeat(reptok, reptoklen, atom, atomlen,
-				firstnum, secondnum, REPEAT_PLUS_APPENDED);
-		}
-	} else if (firstnum == secondnum) {	/* {n} or {n,n} -> simply repeat n-1 times */
-		if (firstnum == 0) {	/* {0} or {0,0} */
-			/* This case is unusual because the resulting
-			   replacement string might actually be SMALLER than
-			   the original ERE */
-			return replace_repeat(reptok, reptoklen, atom, atomlen,
-					firstnum, secondnum, REPEAT_ZERO);
-		} else {		/* (firstnum >= 1) */
-			return replace_repeat(reptok, reptoklen, atom, atomlen,
-					firstnum, secondnum, REPEAT_SIMPLE);
-		}
-	} else if (firstnum < secondnum) {	/* {n,m} -> repeat n-1 times then alternate  */
-		/*  x{n,m}  =>  xx...x{1, m-n+1}  =>  xx...x?x?x?..x?	*/
-		return replace_repeat(reptok, reptoklen, atom, atomlen,
-					firstnum, secondnum, REPEAT_WITH_Q);
-	} else {	/* Error - shouldn't be here (n>m) */
-		FATAL("internal error");
-	}
-	return 0;
-}
-
 int relex(void)		/* lexical analyzer for reparse */
 {
 	int c, n;
@@ -1256,18 +2896,15 @@ int relex(void)		/* lexical analyzer for reparse */
 	static int bufsz = 100;
 	uschar *bp;
 	const struct charclass *cc;
+	uint32_t named[8];	/* runes in [:name:] classes */
+	bool cnamed;
 	int i;
 	int num, m;
 	bool commafound, digitfound;
-	const uschar *startreptok;
 	static int parens = 0;
 
-rescan:
-	starttok = prestr;
-
 	if ((n = u8_rune(&rlxval, (const char *) prestr)) > 1) {
 		prestr += n;
-		starttok = prestr;
 		return CHAR;
 	}
 
@@ -1308,6 +2945,8 @@ rescan:
 		}
 		else
 			cflag = 0;
+		memset(named, 0, sizeof(named));
+		cnamed = false;
 		n = 5 * strlen((const char *) prestr)+1; /* BUG: was 2.  what value? */
 		if (!adjbuf((char **) &buf, &bufsz, n, n, (char **) &bp, "relex1"))
 			FATAL("out of space for reg expr %.10s...", lastre);
@@ -1333,27 +2972,19 @@ rescan:
 				    prestr[2 + cc->cc_namelen] == ']') {
 					prestr += cc->cc_namelen + 3;
 					/*
-					 * BUG: We begin at 1, instead of 0, since we
-					 * would otherwise prematurely terminate the
-					 * string for classes like [[:cntrl:]]. This
-					 * means that we can't match the NUL character,
-					 * not without first adapting the entire
-					 * program to track each string's length.
+					 * The class goes straight into the
+					 * bitmap rather than into buf.
+					 * BUG: We begin at 1, instead of 0,
+					 * since NUL ends the string being
+					 * matched.  This means that we can't
+					 * match the NUL character, not without
+					 * first adapting the entire program to
+					 * track each string's length.
 					 */
-					for (i = 1; i <= UCHAR_MAX; i++) {
-						if (!adjbuf((char **) &buf, &bufsz, bp-buf+2, 100, (char **) &bp, "relex2"))
-						    FATAL("out of space for reg expr %.10s...", lastre);
-						if (cc->cc_func(i)) {
-							/* escape backslash */
-							if (i == '\\') {
-								*bp++ = '\\';
-								n++;
-							}
-
-							*bp++ = i;
-							n++;
-						}
-					}
+					for (i = 1; i <= UCHAR_MAX; i++)
+						if (cc->cc_func(i))
+							named[i >> 5] |= 1u << (i & 31);
+					cnamed = true;
 				} else
 					*bp++ = c;
 			} else if (c == '[' && *prestr == '.') {
@@ -1392,11 +3023,13 @@ rescan:
 				}
 			} else if (c == '\0') {
 				FATAL("nonterminated character class %.20s", lastre);
-			} else if (bp == buf) {	/* 1st char is special */
+			} else if (bp == buf && !cnamed) {	/* 1st char is special */
 				*bp++ = c;
 			} else if (c == ']') {
 				*bp++ = 0;
-				rlxstr = (uschar *) tostring((char *) buf);
+				rlxccl = cclenter((char *) buf);
+				for (i = 0; i < 8; i++)
+					rlxccl->bits[i] |= named[i];
 				if (cflag == 0)
 					return CCL;
 				else
@@ -1411,8 +3044,6 @@ rescan:
 			n = -1; m = -1;
 			commafound = false;
 			digitfound = false;
-			startreptok = prestr-1;
-			/* Remember start of previous atom here ? */
 		} else {        	/* just a { char, not a repetition */
 			rlxval = c;
 			return CHAR;
@@ -1443,17 +3074,11 @@ rescan:
 							lastre);
 					}
 				}
-				if (repeat(starttok, prestr-starttok, lastatom,
-					   startreptok - lastatom, n, m) > 0) {
-					if (n == 0 && m == 0) {
-						return ZERO;
-					}
-					/* must rescan input for next token */
-					goto rescan;
-				}
-				/* Failed to replace: eat up {...} characters
-				   and treat like just PLUS */
-				return PLUS;
+				if (n == 0 && m == 0)
+					return ZERO;
+				rlxmin = n;
+				rlxmax = m;
+				return REPEAT;
 			} else if (c == '\0') {
 				FATAL("nonterminated character class %.20s",
 					lastre);
@@ -1478,88 +3103,316 @@ rescan:
 	}
 }
 
+static int bydesc(const void *a, const void *b)	/* for qsort */
+{
+	return *(const int *) b - *(const int *) a;
+}
+
+static unsigned sethash(const int *p)	/* of position set p */
+{
+	unsigned h;
+	int i;
+
+	for (h = p[0], i = 1; i <= p[0]; i++)
+		h = h * 31 + p[i];
+	return h;
+}
+
+/*
+ * f->stab finds a state from its set of positions, so cgoto can
+ * tell whether the set it made is a state already without looking
+ * at all of them.  It is open-addressed, at most half full, and
+ * holds state numbers; the states part way through a utf-8
+ * character are left out.  It is remade when it gets too full or
+ * makeinit changes the sets of the first states.
+ */
+
+static int *stslot(fa *f, const int *set)	/* where set is, or would go */
+{
+	unsigned i, m = f->nstab - 1;
+	int s, *p;
+
+	for (i = sethash(set) & m; (s = f->stab[i]) != 0; i = (i + 1) & m) {
+		p = f->posns[s];
+		if (p[0] == set[0]
+		  && memcmp(p + 1, set + 1, set[0] * sizeof(*set)) == 0)
+			break;
+	}
+	return &f->stab[i];
+}
+
+static void remakestab(fa *f)
+{
+	int i, *slot;
+
+	xfree(f->stab);
+	for (f->nstab = 16; f->nstab < 4 * f->curstat; f->nstab *= 2)
+		;
+	f->stab = intalloc(f->nstab, __func__);
+	for (i = 1; i <= f->curstat; i++)
+		if (f->posns[i] != NULL && f->posns[i][0] >= 0
+		  && *(slot = stslot(f, f->posns[i])) == 0)
+			*slot = i;
+}
+
+static bool isout(fa *f, const int *set)	/* is set an accepting state? */
+{
+	int i;
+
+	if (set[0] > 0 && set[1] == f->accept)
+		return true;
+	if (f->nrule > 0)	/* some rule's FINAL, not just the last */
+		for (i = 1; i <= set[0]; i++)
+			if (set[i] >= 0 && f->re[set[i]].ltype == FINAL)
+				return true;
+	return false;
+}
+
+static bool leafmatch(fa *f, int i, int c)	/* does position i take rune c? */
+{
+	int k = f->re[i].ltype;
+
+	return (k == CHAR && c == ptoi(f->re[i].lval.np))
+	 || (k == DOT && c != 0 && c != HAT)
+	 || (k == ALL && c != 0)
+	 || (k == EMPTYRE && c != 0)
+	 || (k == CCL && member(c, f->re[i].lval.cp))
+	 || (k == NCCL && !member(c, f->re[i].lval.cp) && c != 0 && c != HAT);
+}
+
+/*
+ * A counter is the one position of x in x{n,m}, which repeat makes
+ * when x is a single character or class, in place of m copies of x.
+ * In a set of positions, the counter's own position i says it has
+ * matched no x yet.  The numbers of x's it has matched, 1 to m-1,
+ * are there as runs lo..hi: cntval(f, i, lo, 1) then cntval(f, i, hi, 0),
+ * or just cntval(f, i, lo, 0) if lo == hi.  These are below 0, so they
+ * sort after the positions and a set still starts with accept if it
+ * has it; for each counter they sort by count, so a run's two ends
+ * are next to each other among those of its counter.  All the counts
+ * of a counter take the same characters, so a run stays a run: x{1,64}
+ * anywhere in a line of x's is 1..63, two numbers, rather than 63
+ * positions in every state as the copies were.  The bounds are kept
+ * in f->re[i], and are checked against INT_MAX in cfoll.
+ */
+
+#define	cntval(f, i, c, start)	(-(((c) * 2 + (start)) * ((f)->accept + 1) + (i)))
+
+typedef struct Run {	/* counts lo..hi of the counter at pos */
+	int	pos;
+	int	lo;
+	int	hi;	/* -1 while its end is still to come */
+} Run;
+
+static Run	*runs;
+static int	nruns, maxruns;
+
+static int setpos(fa *f, int e)	/* the position of element e of a set */
+{
+	return e >= 0 ? e : -e % (f->accept + 1);
+}
+
+static void addrun(int pos, int lo, int hi)
+{
+	if (nruns >= maxruns) {
+		maxruns = maxruns > 0 ? 2 * maxruns : 16;
+		runs = (Run *) realloc(runs, maxruns * sizeof(*runs));
+		if (runs == NULL)
+			overflo(__func__);
+	}
+	runs[nruns].pos = pos;
+	runs[nruns].lo = lo;
+	runs[nruns].hi = hi;
+	nruns++;
+}
+
+static void cntrun(fa *f, int e)	/* add the count e from a set to runs */
+{
+	int i, k, t = -e / (f->accept + 1);
+
+	i = setpos(f, e);
+	if (t & 1) {	/* the start of a run; its end comes later */
+		addrun(i, t / 2, -1);
+		return;
+	}
+	for (k = nruns - 1; k >= 0; k--)
+		if (runs[k].pos == i && runs[k].hi < 0) {
+			runs[k].hi = t / 2;
+			return;
+		}
+	addrun(i, t / 2, t / 2);
+}
+
+static int byrun(const void *a, const void *b)	/* for qsort */
+{
+	const Run *r = (const Run *) a, *u = (const Run *) b;
+
+	if (r->pos != u->pos)
+		return r->pos - u->pos;
+	return r->lo - u->lo;
+}
+
+static void cntstep(fa *f, int c)	/* move runs on over c, into tmpset */
+{
+	int i, k, lo, hi, n = nruns;
+	rrow *r;
+
+	for (k = 0; k < n; k++) {
+		if (c == HAT || !leafmatch(f, runs[k].pos, c))	/* ^ is not an x */
+			continue;
+		r = &f->re[runs[k].pos];
+		lo = runs[k].lo + 1;
+		hi = runs[k].hi + 1;
+		if (hi >= r->lmin)	/* some count is within the bounds */
+			for (i = 1; i <= r->lfollow[0]; i++)
+				addpos(r->lfollow[i]);
+		if (hi >= r->lmax)
+			hi = r->lmax - 1;
+		if (lo <= hi)
+			addrun(runs[k].pos, lo, hi);
+	}
+	qsort(runs + n, nruns - n, sizeof(*runs), byrun);
+	for (k = n; k < nruns; ) {	/* merge runs that meet */
+		lo = runs[k].lo;
+		hi = runs[k].hi;
+		for (i = k + 1; i < nruns && runs[i].pos == runs[k].pos
+		  && runs[i].lo <= hi + 1; i++)
+			if (runs[i].hi > hi)
+				hi = runs[i].hi;
+		tmpset[++setcnt] = cntval(f, runs[k].pos, lo, lo < hi);
+		if (lo < hi)
+			tmpset[++setcnt] = cntval(f, runs[k].pos, hi, 0);
+		k = i;
+	}
+}
+
 int cgoto(fa *f, int s, int c)
 {
-	int *p, *q;
-	int i, j, k;
+	int *p, *q, *slot;
+	int i, j, k, m;
 
 	/* assert(c == HAT || c < NCHARS);  BUG: seg fault if disable test */
-	while (f->accept >= maxsetvec) {	/* guessing here! */
-		resizesetvec(__func__);
-	}
-	for (i = 0; i <= f->accept; i++)
-		setvec[i] = 0;
+	/*
+	 * The positions go into tmpset[1..setcnt] as they are found,
+	 * and setvec[i] says where i is in it, if it is: a sparse set,
+	 * which doesn't need clearing.
+	 */
 	setcnt = 0;
+	nruns = 0;
 	resize_state(f, s);
-	/* compute positions of gototab[s,c] into setvec */
+	/* compute positions of gototab[s,c] into tmpset */
 	p = f->posns[s];
+	while (f->accept + 1 + 2 * *p >= maxsetvec) {	/* runs; see cntstep */
+		resizesetvec(__func__);
+	}
 	for (i = 1; i <= *p; i++) {
-		if ((k = f->re[p[i]].ltype) != FINAL) {
-			if ((k == CHAR && c == ptoi(f->re[p[i]].lval.np))
-			 || (k == DOT && c != 0 && c != HAT)
-			 || (k == ALL && c != 0)
-			 || (k == EMPTYRE && c != 0)
-			 || (k == CCL && member(c, (int *) f->re[p[i]].lval.rp))
-			 || (k == NCCL && !member(c, (int *) f->re[p[i]].lval.rp) && c != 0 && c != HAT)) {
-				q = f->re[p[i]].lfollow;
-				for (j = 1; j <= *q; j++) {
-					if (q[j] >= maxsetvec) {
-						resizesetvec(__func__);
-					}
-					if (setvec[q[j]] == 0) {
-						setcnt++;
-						setvec[q[j]] = 1;
-					}
+		if (p[i] < 0)
+			cntrun(f, p[i]);
+		else if (f->re[p[i]].lmax > 0)	/* a counter at 0 */
+			addrun(p[i], 0, 0);
+		else if (leafmatch(f, p[i], c)) {
+			q = f->re[p[i]].lfollow;
+			for (j = 1; j <= *q; j++) {
+				m = setvec[q[j]];
+				if (m < 1 || m > setcnt || tmpset[m] != q[j]) {
+					tmpset[++setcnt] = q[j];
+					setvec[q[j]] = setcnt;
 				}
 			}
 		}
 	}
-	/* determine if setvec is a previous state */
+	if (nruns > 0)
+		cntstep(f, c);
+	/* determine if tmpset is a previous state */
 	tmpset[0] = setcnt;
-	j = 1;
-	for (i = f->accept; i >= 0; i--)
-		if (setvec[i]) {
-			tmpset[j++] = i;
-		}
+	qsort(tmpset + 1, setcnt, sizeof(*tmpset), bydesc);
 	resize_state(f, f->curstat > s ? f->curstat : s);
-	/* tmpset == previous state? */
-	for (i = 1; i <= f->curstat; i++) {
-		p = f->posns[i];
-		if ((k = tmpset[0]) != p[0])
-			goto different;
-		for (j = 1; j <= k; j++)
-			if (tmpset[j] != p[j])
-				goto different;
-		/* setvec is state i */
-		if (c != HAT)
+	if (2 * f->curstat >= f->nstab)
+		remakestab(f);
+	slot = stslot(f, tmpset);
+	if (c != HAT)
+		f->ncomputed++;
+	if ((i = *slot) != 0) {	/* tmpset is state i */
+		if (c != HAT && !f->nocache)
 			set_gototab(f, s, c, i);
 		return i;
-	  different:;
 	}
 
 	/* add tmpset to current set of states */
-	++(f->curstat);
-	resize_state(f, f->curstat);
-	clear_gototab(f, f->curstat);
-	xfree(f->posns[f->curstat]);
+	k = f->nflush;
+	i = newstate(f, s);
+	f->nmade++;
+	if (f->nflush != k)	/* stab has been remade */
+		slot = stslot(f, tmpset);
 	p = intalloc(setcnt + 1, __func__);
 
-	f->posns[f->curstat] = p;
-	if (c != HAT)
-		set_gototab(f, s, c, f->curstat);
-	for (i = 0; i <= setcnt; i++)
-		p[i] = tmpset[i];
-	if (setvec[f->accept])
-		f->out[f->curstat] = 1;
-	else
-		f->out[f->curstat] = 0;
-	return f->curstat;
+	f->posns[i] = p;
+	*slot = i;
+	if (c != HAT && !f->nocache)
+		set_gototab(f, s, c, i);
+	for (j = 0; j <= setcnt; j++)
+		p[j] = tmpset[j];
+	f->out[i] = isout(f, tmpset);
+	return i;
+}
+
+
+size_t fabytes(fa *f)	/* memory f is using, roughly */
+{
+	size_t n;
+	int i, *p;
+	Arena *a;
+
+	n = sizeof(fa) + (f->accept + 1) * sizeof(rrow);
+	n += f->state_count * (sizeof(gtt) + sizeof(f->out[0])
+		+ sizeof(f->posns[0]) + f->nclass * sizeof(f->trans[0])
+		+ sizeof(f->loop[0]) + sizeof(f->esc[0]));
+	for (i = 0; i < f->state_count; i++)
+		n += f->gototab[i].allocated * sizeof(gtte);
+	for (i = 0; i <= f->curstat; i++)
+		if ((p = f->posns[i]) != NULL)
+			n += (p[0] >= 0 ? p[0] + 1 : p[2] + 3) * sizeof(int);
+	for (a = f->arena; a != NULL; a = a->next)
+		n += sizeof(Arena) + (a->size - 1) * sizeof(int);
+	for (i = 0; i <= f->accept; i++) {
+		if (f->re[i].ltype == CCL || f->re[i].ltype == NCCL)
+			n += sizeof(Ccl) + 2 * f->re[i].lval.cp->nrange * sizeof(int);
+	}
+	n += f->nstab * sizeof(f->stab[0]);
+	n += strlen((const char *) f->restr) + 1;
+	if (f->must != NULL)
+		n += strlen(f->must) + 1;
+	if (f->pre != NULL)
+		n += strlen(f->pre) + 1;
+	if (f->first != NULL)
+		n += 256;
+	if (f->ac != NULL) {
+		n += sizeof(*f->ac) + f->ac->maxnode * (5 * sizeof(int) + 1)
+			+ f->ac->nnode * sizeof(int) + f->ac->maxedge * 2 * sizeof(int)
+			+ f->ac->maxrow * f->ac->nclass * sizeof(int);
+		if (f->ac->dfa != NULL)
+			n += fabytes(f->ac->dfa);
+	}
+	return n;
 }
 
+void fareport(void)	/* for -d: what the cached fa's are using */
+{
+	fa *f;
+	size_t n, tot = 0;
+
+	for (f = newest; f != NULL; f = f->older) {
+		n = fabytes(f);
+		tot += n;
+		DPRINTF("fa /%s/: %d states, %zu bytes\n", f->restr, f->curstat + 1, n);
+	}
+	DPRINTF("%d cached fa's, %zu bytes\n", nfatab, tot);
+}
 
 void freefa(fa *f)	/* free a finite automaton */
 {
 	int i;
+	Arena *a;
 
 	if (f == NULL)
 		return;
@@ -1568,14 +3421,24 @@ void freefa(fa *f)	/* free a finite automaton */
 	xfree(f->gototab);
 	for (i = 0; i <= f->curstat; i++)
 		xfree(f->posns[i]);
-	for (i = 0; i <= f->accept; i++) {
-		xfree(f->re[i].lfollow);
+	for (i = 0; i <= f->accept; i++)
 		if (f->re[i].ltype == CCL || f->re[i].ltype == NCCL)
-			xfree(f->re[i].lval.np);
+			xfree(f->re[i].lval.cp);
+	while ((a = f->arena) != NULL) {	/* the follow sets */
+		f->arena = a->next;
+		free(a);
 	}
 	xfree(f->restr);
+	xfree(f->must);
+	xfree(f->pre);
+	xfree(f->first);
 	xfree(f->out);
+	xfree(f->trans);
+	xfree(f->loop);
+	xfree(f->esc);
+	xfree(f->stab);
 	xfree(f->posns);
 	xfree(f->gototab);
+	freeac(f->ac);
 	xfree(f);
 }
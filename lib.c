@@ -32,8 +32,17 @@ THIS SOFTWARE.
 #include <stdarg.h>
 #include <limits.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "awk.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define	SEPSIMD		/* SSE2 always, AVX2 if the cpu has it */
+#include <immintrin.h>
+#endif
+
 extern int u8_nextlen(const char *s);
 
 char	EMPTY[] = { '\0' };
@@ -46,8 +55,14 @@ char	*fields;
 int	fieldssize = RECSIZE;
 
 Cell	**fldtab;	/* pointers to Cells */
+static struct fldpos {	/* where a LAZY field is */
+	int	off;		/* offset of field in $0 */
+	int	len;		/* its length there */
+	bool	quoted;		/* csv "...", with "" for " */
+} *fldpos;
 static size_t	len_inputFS = 0;
 static char	*inputFS = NULL; /* FS at time of input, for field splitting */
+static int	(*fssplit)(const char *, int, const char *, bool, int);	/* see splitws */
 
 #define	MAXFLD	2
 int	nfields	= MAXFLD;	/* last allocated slot for $i */
@@ -62,11 +77,18 @@ extern	Awkfloat *ARGC;
 static Cell dollar0 = { OCELL, CFLD, NULL, EMPTY, 0.0, REC|STR|DONTFREE, NULL, NULL };
 static Cell dollar1 = { OCELL, CFLD, NULL, EMPTY, 0.0, FLD|STR|DONTFREE, NULL, NULL };
 
+static Resite rssite, fssite;	/* fa's of a regular expression RS and FS */
+
+static char *recinplace(FILE *, char **, int *);
+static char *memstr(char *, size_t, const char *, size_t);
+static char *csvend(char *, char *, bool *);
+
 void recinit(unsigned int n)
 {
 	if ( (record = (char *) malloc(n)) == NULL
 	  || (fields = (char *) malloc(n+1)) == NULL
 	  || (fldtab = (Cell **) calloc(nfields+2, sizeof(*fldtab))) == NULL
+	  || (fldpos = (struct fldpos *) calloc(nfields+2, sizeof(*fldpos))) == NULL
 	  || (fldtab[0] = (Cell *) malloc(sizeof(**fldtab))) == NULL)
 		FATAL("out of space for $0 and fields");
 	*record = '\0';
@@ -127,14 +149,21 @@ void savefs(void)
 	size_t len;
 	if ((len = strlen(getsval(fsloc))) < len_inputFS) {
 		strcpy(inputFS, *FS);	/* for subsequent field splitting */
-		return;
+	} else {
+		len_inputFS = len + 1;
+		inputFS = (char *) realloc(inputFS, len_inputFS);
+		if (inputFS == NULL)
+			FATAL("field separator %.10s... is too long", *FS);
+		memcpy(inputFS, *FS, len_inputFS);
 	}
-
-	len_inputFS = len + 1;
-	inputFS = (char *) realloc(inputFS, len_inputFS);
-	if (inputFS == NULL)
-		FATAL("field separator %.10s... is too long", *FS);
-	memcpy(inputFS, *FS, len_inputFS);
+	if (CSV)
+		fssplit = splitcsv;
+	else if (len == 1)
+		fssplit = *inputFS == ' ' ? splitws : splitch;
+	else if (relit(inputFS) > 0)
+		fssplit = splitstr;	/* a string, not really a regular expression */
+	else
+		fssplit = NULL;		/* regular expression, or "" */
 }
 
 static bool firsttime = true;
@@ -142,7 +171,7 @@ static bool firsttime = true;
 int getrec(char **pbuf, int *pbufsize, bool isrecord)	/* get next input record */
 {			/* note: cares whether buf == record */
 	int c;
-	char *buf = *pbuf;
+	char *buf = *pbuf, *rec;
 	uschar saveb0;
 	int bufsize = *pbufsize, savebufsize = bufsize;
 
@@ -176,21 +205,20 @@ int getrec(char **pbuf, int *pbufsize, bool isrecord)	/* get next input record *
 			innew = true;
 			setfval(fnrloc, 0.0);
 		}
-		c = readrec(&buf, &bufsize, infile, innew);
+		rec = NULL;
+		if (isrecord && (rec = recinplace(infile, &buf, &bufsize)) != NULL)
+			c = 1;
+		else
+			c = readrec(&buf, &bufsize, infile, innew);
 		if (innew)
 			innew = false;
 		if (c != 0 || buf[0] != '\0') {	/* normal record */
 			if (isrecord) {
-				double result;
-
 				if (freeable(fldtab[0]))
 					xfree(fldtab[0]->sval);
-				fldtab[0]->sval = buf;	/* buf == record */
-				fldtab[0]->tval = REC | STR | DONTFREE;
-				if (is_number(fldtab[0]->sval, & result)) {
-					fldtab[0]->fval = result;
-					fldtab[0]->tval |= NUM;
-				}
+				/* buf == record */
+				fldtab[0]->sval = rec != NULL ? rec : buf;
+				fldtab[0]->tval = REC | STR | DONTFREE | MAYBENUM;
 				donefld = false;
 				donerec = true;
 				savefs();
@@ -202,8 +230,10 @@ int getrec(char **pbuf, int *pbufsize, bool isrecord)	/* get next input record *
 			return 1;
 		}
 		/* EOF arrived on this file; set up next */
-		if (infile != stdin)
+		if (infile != stdin) {
+			inbufclose(infile);
 			fclose(infile);
+		}
 		infile = NULL;
 		argno++;
 	}
@@ -215,35 +245,327 @@ int getrec(char **pbuf, int *pbufsize, bool isrecord)	/* get next input record *
 
 void nextfile(void)
 {
-	if (infile != NULL && infile != stdin)
+	if (infile != NULL && infile != stdin) {
+		inbufclose(infile);
 		fclose(infile);
+	}
 	infile = NULL;
 	argno++;
 }
 
-extern int readcsvrec(char **pbuf, int *pbufsize, FILE *inf, bool newflag);
+/*
+ * Input is read with read(2) in blocks of INBUFSIZE into an Inbuf
+ * kept for each stream, instead of a getc at a time; separators are
+ * then found with memchr, which is vectorized in any modern libc.
+ * A short read returns whatever is available, so pipes and
+ * terminals stay interactive.  Anything that closes or reopens
+ * an input stream must call inbufclose first.
+ *
+ * Regular files are instead mapped MAPSIZE bytes at a time, so the
+ * kernel does not copy them; only one window is mapped at once, and
+ * --no-mmap turns this off.  The window is read-only, so recinplace
+ * copies records out of it rather than ending them with a NUL, which
+ * would cost a page copy on every page.
+ * Anything past the size the file had when first seen is picked up
+ * with read(), so a file that grows still works.
+ */
+
+bool	usemmap = true;	/* map regular input files */
+
+static Inbuf *inbufs;	/* list of input buffers, most recently used first */
+
+/*
+ * When a record lies entirely within the input buffer, $0 is
+ * left there (NUL-terminated in place of its separator) rather
+ * than being copied into record.  It stays valid until the buffer
+ * is refilled, moved or freed, and recclaim copies it out before
+ * any of that can happen.
+ */
+
+static Inbuf	*recib;		/* buffer that $0 is in, */
+static char	*recptr;	/* at this address */
+
+static void recclaim(Inbuf *ib)	/* copy $0 out of ib if it is there */
+{
+	static char *keep;
+	static int keepsize;
+	int n;
+
+	if (recib != ib)
+		return;
+	recib = NULL;
+	if (fldtab[0]->sval != recptr)	/* $0 has been replaced */
+		return;
+	n = strlen(recptr) + 1;
+	adjbuf(&keep, &keepsize, n, recsize, 0, "recclaim");
+	memcpy(keep, recptr, n);
+	fldtab[0]->sval = keep;
+}
+
+static char *recinplace(FILE *inf, char **pbuf, int *pbufsize)
+{	/* next record, if it is all in the buffer */
+	Inbuf *ib;
+	char *rs, *p, *rec;
+	int n;
+
+	rs = getsval(rsloc);
+	if (!CSV && *rs && rs[1] && relit(rs) == 0)
+		return NULL;
+	ib = inbuf(inf);
+	if (CSV) {
+		bool inq = false;
+
+		p = csvend(ib->pos, ib->end, &inq);
+		if (p == NULL || memchr(ib->pos, '\r', p - ib->pos) != NULL)
+			return NULL;
+		rec = ib->pos;
+		ib->pos = p + 1;
+	} else if (*rs && rs[1]) {	/* a string */
+		p = memstr(ib->pos, ib->end - ib->pos, rs, strlen(rs));
+		if (p == NULL)
+			return NULL;
+		rec = ib->pos;
+		ib->pos = p + strlen(rs);
+	} else if (*rs != 0) {
+		p = (char *) memchr(ib->pos, *rs, ib->end - ib->pos);
+		if (p == NULL)
+			return NULL;
+		rec = ib->pos;
+		ib->pos = p + 1;
+	} else {	/* paragraph mode: up to a blank line */
+		for (p = ib->pos; p < ib->end && *p == '\n'; p++)
+			;
+		for (rec = p; ; p++) {
+			p = (char *) memchr(p, '\n', ib->end - p);
+			if (p == NULL || p + 1 >= ib->end)
+				return NULL;
+			if (p[1] == '\n')
+				break;
+		}
+		ib->pos = p + 2;
+	}
+	if (ib->base == ib->map) {	/* read-only, and writing would copy the page */
+		n = p - rec;
+		if (!adjbuf(pbuf, pbufsize, n + 1, recsize, 0, "recinplace"))
+			FATAL("input record `%.30s...' too long", rec);
+		memcpy(*pbuf, rec, n);
+		(*pbuf)[n] = '\0';
+		return *pbuf;
+	}
+	*p = '\0';
+	recib = ib;
+	recptr = rec;
+	DPRINTF("recinplace saw <%s>\n", rec);
+	return rec;
+}
+
+Inbuf *inbuf(FILE *fp)	/* find or create the buffer for fp */
+{
+	Inbuf *ib, **pib;
+	struct stat sbuf;
+
+	for (pib = &inbufs; (ib = *pib) != NULL; pib = &ib->next)
+		if (ib->fp == fp) {
+			if (ib != inbufs) {	/* move to front */
+				*pib = ib->next;
+				ib->next = inbufs;
+				inbufs = ib;
+			}
+			return ib;
+		}
+	if ((ib = (Inbuf *) calloc(1, sizeof(*ib))) == NULL
+	  || (ib->buf = (char *) malloc(INBUFSIZE)) == NULL)
+		FATAL("out of space for input buffer");
+	ib->fp = fp;
+	ib->size = INBUFSIZE;
+	ib->base = ib->pos = ib->end = ib->buf;
+	if (usemmap && fstat(fileno(fp), &sbuf) == 0 && S_ISREG(sbuf.st_mode)
+	    && (ib->off = lseek(fileno(fp), 0, SEEK_CUR)) >= 0
+	    && ib->off < sbuf.st_size) {
+		ib->mapped = true;
+		ib->fsize = sbuf.st_size;
+	}
+	ib->next = inbufs;
+	inbufs = ib;
+	return ib;
+}
+
+static bool mapwindow(Inbuf *ib)	/* map the window of the file at ib->off */
+{
+	static off_t pagesize;
+	off_t start;
+	size_t len;
+	void *p;
+
+	if (pagesize == 0)
+		pagesize = sysconf(_SC_PAGESIZE);
+	start = ib->off - ib->off % pagesize;
+	len = ib->fsize - start > MAPSIZE ? MAPSIZE : ib->fsize - start;
+	p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(ib->fp), start);
+	if (p == MAP_FAILED)
+		return false;
+#ifdef MADV_SEQUENTIAL
+	(void) madvise(p, len, MADV_SEQUENTIAL);
+#endif
+	ib->map = ib->base = (char *) p;
+	ib->maplen = len;
+	ib->pos = ib->base + (ib->off - start);
+	ib->end = ib->base + len;
+	ib->off = start + len;
+	return true;
+}
+
+int inbuffill(Inbuf *ib)	/* refill an empty buffer; 0 at end of file */
+{
+	ssize_t n;
+
+	if (ib->eof)
+		return 0;
+	recclaim(ib);
+	if (ib->map != NULL) {
+		munmap(ib->map, ib->maplen);
+		ib->map = NULL;
+	}
+	if (ib->mapped) {
+		if (ib->off < ib->fsize && mapwindow(ib))
+			return 1;
+		/* at the old end of file, or can't map: read the rest */
+		ib->mapped = false;
+		(void) lseek(fileno(ib->fp), ib->off, SEEK_SET);
+	}
+	do
+		n = read(fileno(ib->fp), ib->buf, ib->size);
+	while (n < 0 && errno == EINTR);
+	ib->base = ib->pos = ib->buf;
+	if (n <= 0) {
+		ib->eof = true;
+		ib->err = n < 0;
+		ib->end = ib->buf;
+		return 0;
+	}
+	ib->end = ib->buf + n;
+	return 1;
+}
+
+int inbufgetc(Inbuf *ib)	/* getc, for when ibgetc finds the buffer empty */
+{
+	if (ib->pos >= ib->end && !inbuffill(ib))
+		return EOF;
+	return (uschar) *ib->pos++;
+}
+
+void inbufunget(Inbuf *ib, int c)	/* push c back; there is no limit */
+{
+	size_t n;
+
+	if (ib->pos > ib->base && (uschar) ib->pos[-1] == c) {
+		ib->pos--;	/* the usual case: c came from here */
+		return;
+	}
+	recclaim(ib);
+	if (ib->pos == ib->base || ib->base == ib->map) {
+		/* no room, or read-only: move the data into buf */
+		n = ib->end - ib->pos;
+		if (n + 1 > ib->size) {
+			while (n + 1 > ib->size)
+				ib->size *= 2;
+			if ((ib->buf = (char *) realloc(ib->buf, ib->size)) == NULL)
+				FATAL("out of space for input buffer");
+			if (ib->base != ib->map)
+				ib->pos = ib->buf;
+		}
+		memmove(ib->buf + 1, ib->pos, n);
+		ib->base = ib->buf;
+		ib->pos = ib->buf + 1;
+		ib->end = ib->pos + n;
+	}
+	*--ib->pos = c;
+}
+
+void inbufclose(FILE *fp)	/* discard the buffer of a stream being closed */
+{
+	Inbuf *ib, **pib;
+
+	for (pib = &inbufs; (ib = *pib) != NULL; pib = &ib->next)
+		if (ib->fp == fp) {
+			recclaim(ib);
+			*pib = ib->next;
+			if (ib->map != NULL)
+				munmap(ib->map, ib->maplen);
+			free(ib->buf);
+			free(ib);
+			return;
+		}
+}
+
+extern int readcsvrec(char **pbuf, int *pbufsize, Inbuf *ib, bool newflag);
+
+static char *memstr(char *s, size_t n, const char *t, size_t m)	/* t in s[0..n-1] */
+{
+	char *p, *e;
+
+	if (n < m)
+		return NULL;
+	for (p = s, e = s + n - m; (p = (char *) memchr(p, *t, e - p + 1)) != NULL; p++)
+		if (memcmp(p, t, m) == 0)
+			return p;
+		else if (p == e)
+			break;
+	return NULL;
+}
 
 int readrec(char **pbuf, int *pbufsize, FILE *inf, bool newflag)	/* read one record into buf */
 {
 	int sep, c, isrec; // POTENTIAL BUG? isrec is a macro in awk.h
-	char *rr = *pbuf, *buf = *pbuf;
-	int bufsize = *pbufsize;
+	char *rr = *pbuf, *buf = *pbuf, *p;
+	int bufsize = *pbufsize, n, m, k;
 	char *rs = getsval(rsloc);
+	Inbuf *ib = inbuf(inf);
 
 	if (CSV) {
-		c = readcsvrec(&buf, &bufsize, inf, newflag);
+		c = readcsvrec(&buf, &bufsize, ib, newflag);
+		isrec = (c == EOF && rr == buf) ? false : true;
+	} else if (*rs && rs[1] && (m = relit(rs)) > 0) {	/* RS is a string */
+		for (rr = buf, c = 0; ; ) {
+			if (ib->pos >= ib->end && !inbuffill(ib)) {
+				c = EOF;
+				break;
+			}
+			n = ib->end - ib->pos;
+			if (rr == buf && (p = memstr(ib->pos, n, rs, m)) != NULL) {
+				n = p - ib->pos;	/* all in the input buffer */
+				if (!adjbuf(&buf, &bufsize, 1+n, recsize, &rr, "readrec 4"))
+					FATAL("input record `%.30s...' too long", buf);
+				memcpy(buf, ib->pos, n);
+				rr = buf + n;
+				ib->pos = p + m;
+				break;
+			}
+			/* keep all of it; a match can start m-1 back */
+			k = rr - buf > m - 1 ? rr - buf - (m - 1) : 0;
+			if (!adjbuf(&buf, &bufsize, 1+n+rr-buf, recsize, &rr, "readrec 5"))
+				FATAL("input record `%.30s...' too long", buf);
+			memcpy(rr, ib->pos, n);
+			rr += n;
+			ib->pos = ib->end;
+			if ((p = memstr(buf + k, rr - buf - k, rs, m)) != NULL) {
+				ib->pos -= rr - (p + m);	/* it ends in this block */
+				rr = p;
+				break;
+			}
+		}
+		*rr = 0;
 		isrec = (c == EOF && rr == buf) ? false : true;
 	} else if (*rs && rs[1]) {
 		bool found;
 
-		memset(buf, 0, bufsize);
-		fa *pfa = makedfa(rs, 1);
+		fa *pfa = sitedfa(&rssite, rs, 1);
 		if (newflag)
-			found = fnematch(pfa, inf, &buf, &bufsize, recsize);
+			found = fnematch(pfa, ib, &buf, &bufsize, recsize);
 		else {
 			int tempstat = pfa->initstat;
 			pfa->initstat = 2;
-			found = fnematch(pfa, inf, &buf, &bufsize, recsize);
+			found = fnematch(pfa, ib, &buf, &bufsize, recsize);
 			pfa->initstat = tempstat;
 		}
 		if (found)
@@ -253,26 +575,31 @@ int readrec(char **pbuf, int *pbufsize, FILE *inf, bool newflag)	/* read one rec
 	} else {
 		if ((sep = *rs) == 0) {
 			sep = '\n';
-			while ((c=getc(inf)) == '\n' && c != EOF)	/* skip leading \n's */
+			while ((c = ibgetc(ib)) == '\n')	/* skip leading \n's */
 				;
 			if (c != EOF)
-				ungetc(c, inf);
+				ib->pos--;
 		}
 		for (rr = buf; ; ) {
-			for (; (c=getc(inf)) != sep && c != EOF; ) {
-				if (rr-buf+1 > bufsize)
-					if (!adjbuf(&buf, &bufsize, 1+rr-buf,
-					    recsize, &rr, "readrec 1"))
-						FATAL("input record `%.30s...' too long", buf);
-				*rr++ = c;
+			/* copy up to the next separator a block at a time */
+			if (ib->pos >= ib->end && !inbuffill(ib)) {
+				c = EOF;
+				break;
 			}
-			if (*rs == sep || c == EOF)
+			p = (char *) memchr(ib->pos, sep, ib->end - ib->pos);
+			n = (p != NULL ? p : ib->end) - ib->pos;
+			if (!adjbuf(&buf, &bufsize, 3+n+rr-buf, recsize, &rr, "readrec 1"))
+				FATAL("input record `%.30s...' too long", buf);
+			memcpy(rr, ib->pos, n);
+			rr += n;
+			ib->pos += n;
+			if (p == NULL)
+				continue;
+			c = *ib->pos++;
+			if (*rs == sep)
 				break;
-			if ((c = getc(inf)) == '\n' || c == EOF)	/* 2 in a row */
+			if ((c = ibgetc(ib)) == '\n' || c == EOF)	/* 2 in a row */
 				break;
-			if (!adjbuf(&buf, &bufsize, 2+rr-buf, recsize, &rr,
-			    "readrec 2"))
-				FATAL("input record `%.30s...' too long", buf);
 			*rr++ = '\n';
 			*rr++ = c;
 		}
@@ -296,36 +623,46 @@ int readrec(char **pbuf, int *pbufsize, FILE *inf, bool newflag)	/* read one rec
 */
 
 
-int readcsvrec(char **pbuf, int *pbufsize, FILE *inf, bool newflag) /* csv can have \n's */
+static char *uncr(char *p, char *e)	/* \r\n becomes \n in p..e; returns new e */
+{
+	char *q;
+
+	if ((p = (char *) memchr(p, '\r', e - p)) == NULL)
+		return e;
+	for (q = p; p < e; p++)
+		if (*p != '\r' || p + 1 == e || p[1] != '\n')
+			*q++ = *p;
+	return q;
+}
+
+int readcsvrec(char **pbuf, int *pbufsize, Inbuf *ib, bool newflag) /* csv can have \n's */
 {			/* so read a complete record that might be multiple lines */
-	int sep, c;
-	char *rr = *pbuf, *buf = *pbuf;
+	int c, n;
+	char *rr, *buf = *pbuf, *p;
 	int bufsize = *pbufsize;
 	bool in_quote = false;
 
-	sep = '\n'; /* the only separator; have to skip over \n embedded in "..." */
-	rr = buf;
-	while ((c = getc(inf)) != EOF) {
-		if (c == sep) {
-			if (! in_quote)
-				break;
-			if (rr > buf && rr[-1] == '\r')	// remove \r if was \r\n
-				rr--;
+	/* \n is the only separator; have to skip over \n embedded in "..." */
+	for (rr = buf; ; ) {
+		if (ib->pos >= ib->end && !inbuffill(ib)) {
+			c = EOF;
+			break;
 		}
-
-		if (rr-buf+1 > bufsize)
-			if (!adjbuf(&buf, &bufsize, 1+rr-buf,
-			    recsize, &rr, "readcsvrec 1"))
-				FATAL("input record `%.30s...' too long", buf);
-		*rr++ = c;
-		if (c == '"')
-			in_quote = ! in_quote;
- 	}
-	if (c == '\n' && rr > buf && rr[-1] == '\r') 	// remove \r if was \r\n
+		p = csvend(ib->pos, ib->end, &in_quote);
+		n = (p != NULL ? p : ib->end) - ib->pos;
+		if (!adjbuf(&buf, &bufsize, 2+n+rr-buf, recsize, &rr, "readcsvrec 1"))
+			FATAL("input record `%.30s...' too long", buf);
+		memcpy(rr, ib->pos, n);
+		rr += n;
+		ib->pos += n;
+		if (p != NULL) {
+			c = *ib->pos++;
+			break;
+		}
+	}
+	rr = uncr(buf, rr);	/* remove \r if was \r\n */
+	if (c == '\n' && rr > buf && rr[-1] == '\r')
 		rr--;
-
-	if (!adjbuf(&buf, &bufsize, 1+rr-buf, recsize, &rr, "readcsvrec 4"))
-		FATAL("input record `%.30s...' too long", buf);
 	*rr = 0;
 	*pbuf = buf;
 	*pbufsize = bufsize;
@@ -376,20 +713,407 @@ void setclvar(char *s)	/* set var=value from s */
 }
 
 
+/*
+ * Splitting on blanks or on a single character looks at the record
+ * 64 bytes at a time.  sepmask returns a word with bit i set if p[i]
+ * is a, b or c, and the fields are read off those bits.  It is the
+ * widest kernel the cpu has, picked on first use.  An FS with no
+ * regular expression operators in it is looked for with strstr.
+ * memchrset uses the same kernels to find the first of a few bytes
+ * in a buffer with no NUL at the end, for the dfa in b.c.
+ *
+ * savefs picks splitws, splitch, splitstr or splitcsv as fssplit for
+ * each new FS.  Each splits s[0..n-1], which is followed by a \0,
+ * into at most lim fields, leaving the start and end of field i+1 in
+ * fsbound[2*i] and fsbound[2*i+1].  nl says \n separates fields too
+ * (RS="").
+ */
+
+typedef uint64_t (*Sepmask)(const char *, int, int, int);
+
+static uint64_t pickmask(const char *, int, int, int);
+static Sepmask sepmask = pickmask;
+
+int	*fsbound;
+static int fsboundsize;
+
+#ifdef SEPSIMD
+static uint64_t sepmask_sse2(const char *p, int a, int b, int c)
+{
+	__m128i va = _mm_set1_epi8((char) a);
+	__m128i vb = _mm_set1_epi8((char) b);
+	__m128i vc = _mm_set1_epi8((char) c);
+	__m128i v, e;
+	uint64_t m = 0;
+	int i;
+
+	for (i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (p + i));
+		e = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+		    _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc));
+		m |= (uint64_t) (unsigned) _mm_movemask_epi8(e) << i;
+	}
+	return m;
+}
+
+__attribute__((__target__("avx2")))
+static uint64_t sepmask_avx2(const char *p, int a, int b, int c)
+{
+	__m256i va = _mm256_set1_epi8((char) a);
+	__m256i vb = _mm256_set1_epi8((char) b);
+	__m256i vc = _mm256_set1_epi8((char) c);
+	__m256i v, e;
+	uint64_t m = 0;
+	int i;
+
+	for (i = 0; i < 64; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (p + i));
+		e = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+		    _mm256_cmpeq_epi8(v, vb)), _mm256_cmpeq_epi8(v, vc));
+		m |= (uint64_t) (uint32_t) _mm256_movemask_epi8(e) << i;
+	}
+	return m;
+}
+#else
+static uint64_t sepmask_byte(const char *p, int a, int b, int c)
+{
+	uint64_t m = 0;
+	int i, x;
+
+	for (i = 0; i < 64; i++) {
+		x = (uschar) p[i];
+		if (x == a || x == b || x == c)
+			m |= (uint64_t) 1 << i;
+	}
+	return m;
+}
+#endif
+
+static uint64_t pickmask(const char *p, int a, int b, int c)	/* set sepmask */
+{
+#ifdef SEPSIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		sepmask = sepmask_avx2;
+	else
+		sepmask = sepmask_sse2;
+#else
+	sepmask = sepmask_byte;
+#endif
+	return sepmask(p, a, b, c);
+}
+
+#ifdef __GNUC__
+#define	lowbit(m)	__builtin_ctzll(m)
+#else
+static int lowbit(uint64_t m)	/* index of lowest 1 bit; m != 0 */
+{
+	int i;
+
+	for (i = 0; (m & 1) == 0; i++)
+		m >>= 1;
+	return i;
+}
+#endif
+
+static uint64_t shortmask(const char *p, int k, int a, int b, int c)
+{	/* sepmask of p[0..k-1], k < 64; the bits past k are 0 */
+	char tail[64];
+
+	memcpy(tail, p, k);
+	memset(tail + k, 0, 64 - k);
+	return sepmask(tail, a, b, c) & (((uint64_t) 1 << k) - 1);
+}
+
+static uint64_t blockmask(const char *s, int n, int off, int a, int b, int c)
+{	/* sepmask of s[off..off+63]; bytes at or past n count as separators */
+	int k = n - off;
+
+	if (k >= 64)
+		return sepmask(s + off, a, b, c);
+	return shortmask(s + off, k, a, b, c) | ~(uint64_t) 0 << k;
+}
+
+static uint64_t prefixxor(uint64_t m)	/* bit i = parity of bits 0..i of m */
+{
+	m ^= m << 1;
+	m ^= m << 2;
+	m ^= m << 4;
+	m ^= m << 8;
+	m ^= m << 16;
+	m ^= m << 32;
+	return m;
+}
+
+const char *memchrset(const char *p, const char *e, const char *set)
+{	/* first byte in p..e that is NUL or in set (at most 8 bytes), or e */
+	uschar b[9];
+	uint64_t m;
+	int i, k, n;
+
+	b[0] = '\0';
+	for (n = 1; *set != '\0'; n++)
+		b[n] = (uschar) *set++;
+	for (i = n; i % 3 != 0; i++)	/* sepmask takes bytes three at a time */
+		b[i] = '\0';
+	for ( ; p < e; p += 64) {
+		k = e - p;
+		for (m = 0, i = 0; i < n; i += 3)
+			m |= k >= 64 ? sepmask(p, b[i], b[i+1], b[i+2])
+			    : shortmask(p, k, b[i], b[i+1], b[i+2]);
+		if (m != 0)
+			return p + lowbit(m);
+	}
+	return e;
+}
+
+static void fsroom(int n, int lim)	/* room in fsbound for a split of n bytes */
+{
+	int k = n < lim ? n + 1 : lim;	/* most fields there can be */
+
+	if (2 * k > fsboundsize) {
+		fsboundsize = 2 * k;
+		fsbound = (int *) realloc(fsbound, fsboundsize * sizeof(*fsbound));
+		if (fsbound == NULL)
+			FATAL("out of space splitting fields");
+	}
+}
+
+int splitws(const char *s, int n, const char *fs, bool nl, int lim)
+{	/* split on blanks; fs and nl are not used */
+	uint64_t m, e, carry = 1;	/* as if there were a blank before s */
+	int off, i = 0;
+	bool in = false;	/* inside field i+1 */
+
+	fsroom(n, lim);
+	for (off = 0; off < n; off += 64) {
+		m = blockmask(s, n, off, ' ', '\t', '\n');
+		e = m ^ (m << 1 | carry);	/* where fields start and end */
+		carry = m >> 63;
+		if (in && e != 0) {
+			fsbound[2*i+1] = off + lowbit(e);
+			e &= e - 1;
+			in = false;
+			if (++i >= lim)
+				return i;
+		}
+		while (e != 0) {
+			fsbound[2*i] = off + lowbit(e);
+			e &= e - 1;
+			if (e == 0) {
+				in = true;
+				break;
+			}
+			fsbound[2*i+1] = off + lowbit(e);
+			e &= e - 1;
+			if (++i >= lim)
+				return i;
+		}
+	}
+	if (in)
+		fsbound[2*i++ + 1] = n;
+	return i;
+}
+
+int splitch(const char *s, int n, const char *fs, bool nl, int lim)
+{	/* split on the character *fs */
+	uint64_t m;
+	int off, b, i = 0, start = 0;
+	int c1 = (uschar) *fs, c2 = nl ? '\n' : c1;
+
+	if (n == 0)
+		return 0;
+	fsroom(n, lim);
+	for (off = 0; off < n; off += 64) {
+		m = blockmask(s, n, off, c1, c2, c2);
+		while (m != 0 && (b = off + lowbit(m)) < n) {
+			fsbound[2*i] = start;
+			fsbound[2*i+1] = b;
+			if (++i >= lim)
+				return i;
+			start = b + 1;
+			m &= m - 1;
+		}
+	}
+	fsbound[2*i] = start;
+	fsbound[2*i+1] = n;
+	return i + 1;
+}
+
+int splitstr(const char *s, int n, const char *fs, bool nl, int lim)
+{	/* split on the string fs; nl is not used */
+	const char *p, *q;
+	int i = 0, len = strlen(fs);
+
+	if (n == 0)
+		return 0;
+	fsroom(n, lim);
+	for (p = s; (q = strstr(p, fs)) != NULL; p = q + len) {
+		fsbound[2*i] = p - s;
+		fsbound[2*i+1] = q - s;
+		if (++i >= lim)
+			return i;
+	}
+	fsbound[2*i] = p - s;
+	fsbound[2*i+1] = n;
+	return i + 1;
+}
+
+/*
+ * CSV fields can't be read off one mask, since a comma inside "..."
+ * doesn't count and a stray " outside doesn't start anything.  So
+ * splitcsv keeps masks of the quotes and commas of one block and
+ * walks from one to the next of whichever it is looking for.
+ */
+
+typedef struct Csvscan {
+	const char *s;
+	int	n;
+	int	off;		/* block the masks are for */
+	uint64_t q, c;		/* quotes, commas */
+} Csvscan;
+
+static int csvnext(Csvscan *cs, int from, int ch)	/* next ch at or after from, else n */
+{
+	uint64_t m;
+	int k;
+
+	while (from < cs->n) {
+		if (from >= cs->off + 64) {
+			cs->off = from & ~63;
+			if ((k = cs->n - cs->off) >= 64) {
+				cs->q = sepmask(cs->s + cs->off, '"', '"', '"');
+				cs->c = sepmask(cs->s + cs->off, ',', ',', ',');
+			} else {
+				cs->q = shortmask(cs->s + cs->off, k, '"', '"', '"');
+				cs->c = shortmask(cs->s + cs->off, k, ',', ',', ',');
+			}
+		}
+		m = (ch == '"' ? cs->q : cs->c) & ~(uint64_t) 0 << (from - cs->off);
+		if (m != 0)
+			return cs->off + lowbit(m);
+		from = cs->off + 64;
+	}
+	return cs->n;
+}
+
+int splitcsv(const char *s, int n, const char *fs, bool nl, int lim)
+{	/* split CSV; a field that was "..." starts just after the " */
+	Csvscan cs;
+	int p = 0, i = 0;
+
+	if (n == 0)
+		return 0;
+	fsroom(n, lim);
+	cs.s = s;
+	cs.n = n;
+	cs.off = -64;
+	for (;;) {
+		if (s[p] == '"') {	/* start of "..." */
+			fsbound[2*i] = ++p;
+			while ((p = csvnext(&cs, p, '"')) < n) {
+				if (s[p+1] == '"')
+					p += 2;	/* doubled quote */
+				else if (s[p+1] == ',' || s[p+1] == '\0')
+					break;
+				else
+					p++;
+			}
+			fsbound[2*i+1] = p;
+			if (p < n)
+				p++;	/* skip over closing quote */
+		} else {	/* unquoted field */
+			fsbound[2*i] = p;
+			fsbound[2*i+1] = p = csvnext(&cs, p, ',');
+		}
+		if (++i >= lim || p++ >= n)
+			break;
+	}
+	return i;
+}
+
+static char *csvend(char *p, char *end, bool *inq)	/* first \n not in "..." */
+{	/* in p..end, or NULL; *inq says p is in "..." and is updated */
+	uint64_t q, nl, in, carry = *inq ? ~(uint64_t) 0 : 0;
+	int k;
+
+	for ( ; p < end; p += 64) {
+		if ((k = end - p) >= 64) {
+			q = sepmask(p, '"', '"', '"');
+			nl = sepmask(p, '\n', '\n', '\n');
+		} else {
+			q = shortmask(p, k, '"', '"', '"');
+			nl = shortmask(p, k, '\n', '\n', '\n');
+		}
+		in = prefixxor(q) ^ carry;	/* each " goes in or out */
+		if ((nl &= ~in) != 0)
+			return p + lowbit(nl);
+		carry = in >> 63 ? ~(uint64_t) 0 : 0;
+	}
+	*inq = carry != 0;
+	return NULL;
+}
+
+/*
+ * Fields are not copied out of $0 when it is split; fldbld only
+ * records where each one is in fldpos[], and marks the cell LAZY.
+ * A field gets its string, in fields[] at the same offset it has
+ * in $0, when the program asks for it through fieldadr.  Like $0,
+ * it is MAYBENUM until something needs to know if it's a number.
+ */
+
+static void setfldpos(int i, int off, int len, bool quoted)	/* field i is at off in $0 */
+{
+	Cell *p;
+
+	if (i > nfields)
+		growfldtab(i);
+	p = fldtab[i];
+	if (freeable(p))
+		xfree(p->sval);
+	p->sval = EMPTY;
+	p->tval = FLD | STR | DONTFREE | LAZY | MAYBENUM;
+	fldpos[i].off = off;
+	fldpos[i].len = len;
+	fldpos[i].quoted = quoted;
+}
+
+static void getfld(int i)	/* copy field i out of $0 */
+{
+	Cell *p = fldtab[i];
+	const char *r = fldtab[0]->sval + fldpos[i].off;
+	const char *e = r + fldpos[i].len;
+	char *fr = fields + fldpos[i].off;
+
+	p->sval = fr;
+	if (fldpos[i].quoted) {
+		while (r < e) {
+			if (*r == '"' && r+1 < e && r[1] == '"')
+				r++;	/* doubled quote */
+			*fr++ = *r++;
+		}
+	} else {
+		memcpy(fr, r, e - r);
+		fr += e - r;
+	}
+	*fr = '\0';
+	p->tval &= ~LAZY;
+}
+
 void fldbld(void)	/* create fields from current record */
 {
 	/* this relies on having fields[] the same length as $0 */
 	/* the fields are all stored in this one array with \0's */
 	/* possibly with a final trailing \0 not associated with any field */
-	char *r, *fr, sep;
+	char *r, *rec, sep;
 	Cell *p;
-	int i, j, n;
+	int i, j, k, n, lim;
 
 	if (donefld)
 		return;
 	if (!isstr(fldtab[0]))
 		getsval(fldtab[0]);
-	r = fldtab[0]->sval;
+	r = rec = fldtab[0]->sval;
 	n = strlen(r);
 	if (n > fieldssize) {
 		xfree(fields);
@@ -397,67 +1121,23 @@ void fldbld(void)	/* create fields from current record */
 			FATAL("out of space for fields in fldbld %d", n);
 		fieldssize = n;
 	}
-	fr = fields;
 	i = 0;	/* number of fields accumulated here */
+	lim = maxfield > 0 ? maxfield : INT_MAX;	/* no need to go further */
 	if (inputFS == NULL)	/* make sure we have a copy of FS */
 		savefs();
-	if (!CSV && strlen(inputFS) > 1) {	/* it's a regular expression */
-		i = refldbld(r, inputFS);
-	} else if (!CSV && (sep = *inputFS) == ' ') {	/* default whitespace */
-		for (i = 0; ; ) {
-			while (*r == ' ' || *r == '\t' || *r == '\n')
-				r++;
-			if (*r == 0)
-				break;
-			i++;
-			if (i > nfields)
-				growfldtab(i);
-			if (freeable(fldtab[i]))
-				xfree(fldtab[i]->sval);
-			fldtab[i]->sval = fr;
-			fldtab[i]->tval = FLD | STR | DONTFREE;
-			do
-				*fr++ = *r++;
-			while (*r != ' ' && *r != '\t' && *r != '\n' && *r != '\0');
-			*fr++ = 0;
-		}
-		*fr = 0;
-	} else if (CSV) {	/* CSV processing.  no error handling */
-		if (*r != 0) {
-			for (;;) {
-				i++;
-				if (i > nfields)
-					growfldtab(i);
-				if (freeable(fldtab[i]))
-					xfree(fldtab[i]->sval);
-				fldtab[i]->sval = fr;
-				fldtab[i]->tval = FLD | STR | DONTFREE;
-				if (*r == '"' ) { /* start of "..." */
-					for (r++ ; *r != '\0'; ) {
-						if (*r == '"' && r[1] != '\0' && r[1] == '"') {
-							r += 2; /* doubled quote */
-							*fr++ = '"';
-						} else if (*r == '"' && (r[1] == '\0' || r[1] == ',')) {
-							r++; /* skip over closing quote */
-							break;
-						} else {
-							*fr++ = *r++;
-						}
-					}
-					*fr++ = 0;
-				} else {	/* unquoted field */
-					while (*r != ',' && *r != '\0')
-						*fr++ = *r++;
-					*fr++ = 0;
-				}
-				if (*r++ == 0)
-					break;
-	
-			}
+	if (fssplit != NULL) {	/* blanks, a single character or a string */
+		/* subtle case: if length(FS) == 1 && length(RS) == 0
+		 * \n is also a field separator (cf awk book 61,84).
+		 */
+		i = fssplit(rec, n, inputFS, **RS == 0, lim);
+		for (j = 0; j < i; j++) {
+			k = fsbound[2*j];
+			setfldpos(j+1, k, fsbound[2*j+1] - k, CSV && k > 0 && rec[k-1] == '"');
 		}
-		*fr = 0;
+	} else if (strlen(inputFS) > 1) {	/* it's a regular expression */
+		i = refldbld(r, inputFS);
 	} else if ((sep = *inputFS) == 0) {	/* new: FS="" => 1 char/field */
-		for (i = 0; *r != '\0'; ) {
+		for (i = 0; *r != '\0' && i < lim; ) {
 			char buf[10];
 			i++;
 			if (i > nfields)
@@ -469,52 +1149,19 @@ void fldbld(void)	/* create fields from current record */
 				buf[j] = *r++;
 			buf[j] = '\0';
 			fldtab[i]->sval = tostring(buf);
-			fldtab[i]->tval = FLD | STR;
+			fldtab[i]->tval = FLD | STR | MAYBENUM;
 		}
-		*fr = 0;
-	} else if (*r != 0) {	/* if 0, it's a null field */
-		/* subtle case: if length(FS) == 1 && length(RS > 0)
-		 * \n is NOT a field separator (cf awk book 61,84).
-		 * this variable is tested in the inner while loop.
-		 */
-		int rtest = '\n';  /* normal case */
-		if (strlen(*RS) > 0)
-			rtest = '\0';
-		for (;;) {
-			i++;
-			if (i > nfields)
-				growfldtab(i);
-			if (freeable(fldtab[i]))
-				xfree(fldtab[i]->sval);
-			fldtab[i]->sval = fr;
-			fldtab[i]->tval = FLD | STR | DONTFREE;
-			while (*r != sep && *r != rtest && *r != '\0')	/* \n is always a separator */
-				*fr++ = *r++;
-			*fr++ = 0;
-			if (*r++ == 0)
-				break;
-		}
-		*fr = 0;
 	}
 	if (i > nfields)
 		FATAL("record `%.30s...' has too many fields; can't happen", r);
 	cleanfld(i+1, lastfld);	/* clean out junk from previous record */
 	lastfld = i;
 	donefld = true;
-	for (j = 1; j <= lastfld; j++) {
-		double result;
-
-		p = fldtab[j];
-		if(is_number(p->sval, & result)) {
-			p->fval = result;
-			p->tval |= NUM;
-		}
-	}
 	setfval(nfloc, (Awkfloat) lastfld);
 	donerec = true; /* restore */
 	if (dbg) {
 		for (j = 0; j <= lastfld; j++) {
-			p = fldtab[j];
+			p = fieldadr(j);
 			printf("field %d (%s): |%s|\n", j, p->nval, p->sval);
 		}
 	}
@@ -564,6 +1211,10 @@ Cell *fieldadr(int n)	/* get nth field */
 		FATAL("trying to access out of range field %d", n);
 	if (n > nfields)	/* fields after NF are empty */
 		growfldtab(n);	/* but does not increase NF */
+	if (n > 0 && !donefld)
+		fldbld();
+	if (fldtab[n]->tval & LAZY)
+		getfld(n);
 	return(fldtab[n]);
 }
 
@@ -575,11 +1226,13 @@ void growfldtab(int n)	/* make new fields up to at least $n */
 	if (n > nf)
 		nf = n;
 	s = (nf+1) * (sizeof (struct Cell *));  /* freebsd: how much do we need? */
-	if (s / sizeof(struct Cell *) - 1 == (size_t)nf) /* didn't overflow */
+	if (s / sizeof(struct Cell *) - 1 == (size_t)nf) { /* didn't overflow */
 		fldtab = (Cell **) realloc(fldtab, s);
-	else					/* overflow sizeof int */
+		fldpos = (struct fldpos *) realloc(fldpos, (nf+1) * sizeof(*fldpos));
+	} else {				/* overflow sizeof int */
 		xfree(fldtab);	/* make it null */
-	if (fldtab == NULL)
+	}
+	if (fldtab == NULL || fldpos == NULL)
 		FATAL("out of space creating %d fields", nf);
 	makefields(nfields+1, nf);
 	nfields = nf;
@@ -587,44 +1240,29 @@ void growfldtab(int n)	/* make new fields up to at least $n */
 
 int refldbld(const char *rec, const char *fs)	/* build fields from reg expr in FS */
 {
-	/* this relies on having fields[] the same length as $0 */
-	/* the fields are all stored in this one array with \0's */
-	char *fr;
-	int i, tempstat, n;
+	const char *rec0 = rec;
+	int i, tempstat;
 	fa *pfa;
 
-	n = strlen(rec);
-	if (n > fieldssize) {
-		xfree(fields);
-		if ((fields = (char *) malloc(n+1)) == NULL)
-			FATAL("out of space for fields in refldbld %d", n);
-		fieldssize = n;
-	}
-	fr = fields;
-	*fr = '\0';
 	if (*rec == '\0')
 		return 0;
-	pfa = makedfa(fs, 1);
+	pfa = sitedfa(&fssite, fs, 1);
 	DPRINTF("into refldbld, rec = <%s>, pat = <%s>\n", rec, fs);
 	tempstat = pfa->initstat;
 	for (i = 1; ; i++) {
-		if (i > nfields)
-			growfldtab(i);
-		if (freeable(fldtab[i]))
-			xfree(fldtab[i]->sval);
-		fldtab[i]->tval = FLD | STR | DONTFREE;
-		fldtab[i]->sval = fr;
 		DPRINTF("refldbld: i=%d\n", i);
 		if (nematch(pfa, rec)) {
 			pfa->initstat = 2;	/* horrible coupling to b.c */
 			DPRINTF("match %s (%d chars)\n", patbeg, patlen);
-			strncpy(fr, rec, patbeg-rec);
-			fr += patbeg - rec + 1;
-			*(fr-1) = '\0';
+			setfldpos(i, rec - rec0, patbeg - rec, false);
 			rec = patbeg + patlen;
+			if (i == maxfield) {	/* the rest is never used */
+				pfa->initstat = tempstat;
+				break;
+			}
 		} else {
 			DPRINTF("no match %s\n", rec);
-			strcpy(fr, rec);
+			setfldpos(i, rec - rec0, strlen(rec), false);
 			pfa->initstat = tempstat;
 			break;
 		}
@@ -640,6 +1278,8 @@ void recbld(void)	/* create $0 from $1..$NF if necessary */
 
 	if (donerec)
 		return;
+	for (i = 1; i <= *NF; i++)	/* before $0 is overwritten */
+		fieldadr(i);
 	r = record;
 	for (i = 1; i <= *NF; i++) {
 		p = getsval(fldtab[i]);
@@ -181,6 +181,26 @@ int main(int argc, char *argv[])
 			argv++;
 			continue;
 		}
+		if (strcmp(argv[1], "--no-mmap") == 0) {	/* read files, don't map them */
+			usemmap = false;
+			argc--;
+			argv++;
+			continue;
+		}
+		if (strncmp(argv[1], "--recache=", 10) == 0) {	/* size of fa cache */
+			if ((nrecache = atoi(&argv[1][10])) < 1)
+				FATAL("invalid --recache size: %s", &argv[1][10]);
+			argc--;
+			argv++;
+			continue;
+		}
+		if (strncmp(argv[1], "--restates=", 11) == 0) {	/* states per fa */
+			if ((nrestates = atoi(&argv[1][11])) < 1)
+				FATAL("invalid --restates size: %s", &argv[1][11]);
+			argc--;
+			argv++;
+			continue;
+		}
 		switch (argv[1][1]) {
 		case 's':
 			if (strcmp(argv[1], "-safe") == 0)
@@ -255,6 +275,8 @@ int main(int argc, char *argv[])
 	if (errorflag == 0) {
 		compile_time = RUNNING;
 		run(winner);
+		if (dbg)
+			fareport();
 	} else
 		bracecheck();
 	return(errorflag);
@@ -26,6 +26,7 @@ THIS SOFTWARE.
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "awk.h"
 #include "awkgram.tab.h"
 
@@ -93,6 +94,20 @@ Node *node4(int a, Node *b, Node *c, Node *d, Node *e)
 	return(x);
 }
 
+Node *node5(int a, Node *b, Node *c, Node *d, Node *e, Node *f)
+{
+	Node *x;
+
+	x = nodealloc(5);
+	x->nobj = a;
+	x->narg[0] = b;
+	x->narg[1] = c;
+	x->narg[2] = d;
+	x->narg[3] = e;
+	x->narg[4] = f;
+	return(x);
+}
+
 Node *stat1(int a, Node *b)
 {
 	Node *x;
@@ -165,6 +180,15 @@ Node *op4(int a, Node *b, Node *c, Node *d, Node *e)
 	return(x);
 }
 
+Node *op5(int a, Node *b, Node *c, Node *d, Node *e, Node *f)
+{
+	Node *x;
+
+	x = node5(a,b,c,d,e,f);
+	x->ntype = NEXPR;
+	return(x);
+}
+
 Node *celltonode(Cell *a, int b)
 {
 	Node *x;
@@ -182,6 +206,42 @@ Node *rectonode(void)	/* make $0 into a Node */
 	return op1(INDIRECT, celltonode(literal0, CUNK));
 }
 
+/*
+ * maxfield is the highest $n the program can refer to, so fldbld
+ * need not split past it.  It is -1 if that can't be told: $expr,
+ * NF (which needs every field counted), SYMTAB, or assigning to a
+ * field, since $0 then has to be rebuilt from all of them.
+ */
+
+int	maxfield = 0;
+
+Node *fieldref(Node *p)	/* $p */
+{
+	double n;
+
+	if (maxfield >= 0) {
+		if (constnode(p)
+		    && (n = getfval((Cell *) p->narg[0])) >= 0 && n <= INT_MAX) {
+			if ((int) n > maxfield)
+				maxfield = (int) n;
+		} else
+			maxfield = -1;
+	}
+	return op1(INDIRECT, p);
+}
+
+Node *fieldset(Node *p)	/* p is about to be assigned to */
+{
+	Node *q;
+
+	if (!isvalue(p) && p->nobj == INDIRECT) {
+		q = p->narg[0];
+		if (!constnode(q) || getfval((Cell *) q->narg[0]) >= 1)
+			maxfield = -1;
+	}
+	return p;
+}
+
 Node *makearr(Node *p)
 {
 	Cell *cp;
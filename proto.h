@@ -37,20 +37,24 @@ extern	void	unputstr(const char *);
 
 extern	fa	*makedfa(const char *, bool);
 extern	fa	*mkdfa(const char *, bool);
+extern	void	multidfa(fa **, int);
+extern	int	multimatch(fa *, const char *);
+extern	fa	*sitedfa(Resite *, const char *, bool);
+extern	Resite	*resite(void);
 extern	int	makeinit(fa *, bool);
 extern	void	penter(Node *);
 extern	void	freetr(Node *);
 extern	int	quoted(const uschar **);
-extern	int	*cclenter(const char *);
+extern	Ccl	*cclenter(const char *);
 extern	noreturn void	overflo(const char *);
 extern	void	cfoll(fa *, Node *);
 extern	int	first(Node *);
-extern	void	follow(Node *);
-extern	int	member(int, int *);
+extern	int	member(int, const Ccl *);
+extern	int	relit(const char *);
 extern	int	match(fa *, const char *);
 extern	int	pmatch(fa *, const char *);
 extern	int	nematch(fa *, const char *);
-extern	bool	fnematch(fa *, FILE *, char **, int *, int);
+extern	bool	fnematch(fa *, Inbuf *, char **, int *, int);
 extern	Node	*reparse(const char *);
 extern	Node	*regexp(void);
 extern	Node	*primary(void);
@@ -60,6 +64,8 @@ extern	Node	*unary(Node *);
 extern	int	relex(void);
 extern	int	cgoto(fa *, int, int);
 extern	void	freefa(fa *);
+extern	size_t	fabytes(fa *);
+extern	void	fareport(void);
 
 extern	int	pgetc(void);
 extern	char	*cursource(void);
@@ -70,16 +76,20 @@ extern	Node	*node1(int, Node *);
 extern	Node	*node2(int, Node *, Node *);
 extern	Node	*node3(int, Node *, Node *, Node *);
 extern	Node	*node4(int, Node *, Node *, Node *, Node *);
+extern	Node	*node5(int, Node *, Node *, Node *, Node *, Node *);
 extern	Node	*stat3(int, Node *, Node *, Node *);
 extern	Node	*op2(int, Node *, Node *);
 extern	Node	*op1(int, Node *);
 extern	Node	*stat1(int, Node *);
 extern	Node	*op3(int, Node *, Node *, Node *);
 extern	Node	*op4(int, Node *, Node *, Node *, Node *);
+extern	Node	*op5(int, Node *, Node *, Node *, Node *, Node *);
 extern	Node	*stat2(int, Node *, Node *);
 extern	Node	*stat4(int, Node *, Node *, Node *, Node *);
 extern	Node	*celltonode(Cell *, int);
 extern	Node	*rectonode(void);
+extern	Node	*fieldref(Node *);
+extern	Node	*fieldset(Node *);
 extern	Node	*makearr(Node *);
 extern	Node	*pa2stat(Node *, Node *, Node *);
 extern	Node	*linkum(Node *, Node *);
@@ -103,6 +113,7 @@ extern	Cell	*lookup(const char *, Array *);
 extern	double	setfval(Cell *, double);
 extern	void	funnyvar(Cell *, const char *);
 extern	char	*setsval(Cell *, const char *);
+extern	void	checknum(Cell *);
 extern	double	getfval(Cell *);
 extern	char	*getsval(Cell *);
 extern	char	*getpssval(Cell *);     /* for print */
@@ -119,8 +130,18 @@ extern	void	savefs(void);
 extern	int	getrec(char **, int *, bool);
 extern	void	nextfile(void);
 extern	int	readrec(char **buf, int *bufsize, FILE *inf, bool isnew);
+extern	Inbuf	*inbuf(FILE *);
+extern	int	inbuffill(Inbuf *);
+extern	int	inbufgetc(Inbuf *);
+extern	void	inbufunget(Inbuf *, int);
+extern	void	inbufclose(FILE *);
 extern	char	*getargv(int);
 extern	void	setclvar(char *);
+extern	int	splitws(const char *, int, const char *, bool, int);
+extern	int	splitch(const char *, int, const char *, bool, int);
+extern	int	splitstr(const char *, int, const char *, bool, int);
+extern	int	splitcsv(const char *, int, const char *, bool, int);
+extern	const char *memchrset(const char *, const char *, const char *);
 extern	void	fldbld(void);
 extern	void	cleanfld(int, int);
 extern	void	newfld(int);
@@ -180,10 +180,70 @@ Cell *execute(Node *u)	/* execute a node of the parse tree */
 }
 
 
+/*
+ * Constant regular expressions matched against $0 in patterns, alone
+ * or with &&, || and !, are gathered up and handed to multidfa so
+ * that one pass over a record serves all of them.
+ */
+
+static fa	**pats;
+static int	npats, maxpats;
+
+static bool isrecnode(Node *x)	/* is x $0? */
+{
+	extern Cell *literal0;
+	Cell *c;
+
+	if (isvalue(x) || x->nobj != INDIRECT || !isvalue(x->narg[0]))
+		return false;
+	c = (Cell *) x->narg[0]->narg[0];
+	return c == literal0 || (constnode(x->narg[0]) && getfval(c) == 0);
+}
+
+static void findpats(Node *x)	/* add the $0 ~ /re/'s in pattern x to pats */
+{
+	if (x == NULL || isvalue(x))
+		return;
+	switch (x->nobj) {
+	case NE:	/* see notnull */
+		if (x->narg[1] == nullnode)
+			findpats(x->narg[0]);
+		break;
+	case AND:
+	case BOR:
+		findpats(x->narg[1]);
+		/* FALLTHROUGH */
+	case NOT:
+		findpats(x->narg[0]);
+		break;
+	case MATCH:
+	case NOTMATCH:
+		if (x->narg[0] != NULL || !isrecnode(x->narg[1]))
+			break;
+		if (((fa *) x->narg[2])->ac != NULL)	/* better on its own */
+			break;
+		if (npats >= maxpats) {
+			maxpats = maxpats > 0 ? 2 * maxpats : 16;
+			pats = (fa **) realloc(pats, maxpats * sizeof(*pats));
+			if (pats == NULL)
+				FATAL("out of space for patterns");
+		}
+		pats[npats++] = (fa *) x->narg[2];
+		break;
+	}
+}
+
 Cell *program(Node **a, int n)	/* execute an awk program */
 {				/* a[0] = BEGIN, a[1] = body, a[2] = END */
 	Cell *x;
-
+	Node *p;
+
+	for (p = a[1]; p != NULL; p = p->nnext)
+		if (p->nobj == PASTAT)
+			findpats(p->narg[0]);
+	if (npats > 1)
+		multidfa(pats, npats);
+	xfree(pats);
 	if (setjmp(env) != 0)
 		goto ex;
 	if (a[0]) {		/* BEGIN */
@@ -376,8 +436,10 @@ Cell *jump(Node **a, int n)	/* break, continue, next, nextfile, return */
 				frp->retval->fval = getfval(y);
 				frp->retval->tval |= NUM;
 			}
-			else if (y->tval & STR)
+			else if (y->tval & STR) {
 				setsval(frp->retval, getsval(y));
+				frp->retval->tval |= y->tval & MAYBENUM;
+			}
 			else if (y->tval & NUM)
 				setfval(frp->retval, getfval(y));
 			else		/* can't happen */
@@ -409,7 +471,6 @@ Cell *awkgetline(Node **a, int n)	/* get next line from specific input */
 	int bufsize = recsize;
 	int mode;
 	bool newflag;
-	double result;
 
 	if ((buf = (char *) malloc(bufsize)) == NULL)
 		FATAL("out of memory in getline");
@@ -432,17 +493,11 @@ Cell *awkgetline(Node **a, int n)	/* get next line from specific input */
 		} else if (a[0] != NULL) {	/* getline var <file */
 			x = execute(a[0]);
 			setsval(x, buf);
-			if (is_number(x->sval, & result)) {
-				x->fval = result;
-				x->tval |= NUM;
-			}
+			x->tval |= MAYBENUM;
 			tempfree(x);
 		} else {			/* getline <file */
 			setsval(fldtab[0], buf);
-			if (is_number(fldtab[0]->sval, & result)) {
-				fldtab[0]->fval = result;
-				fldtab[0]->tval |= NUM;
-			}
+			fldtab[0]->tval |= MAYBENUM;
 		}
 	} else {			/* bare getline; use current input */
 		if (a[0] == NULL)	/* getline */
@@ -452,10 +507,7 @@ Cell *awkgetline(Node **a, int n)	/* get next line from specific input */
 			if (n > 0) {
 				x = execute(a[0]);
 				setsval(x, buf);
-				if (is_number(x->sval, & result)) {
-					x->fval = result;
-					x->tval |= NUM;
-				}
+				x->tval |= MAYBENUM;
 				tempfree(x);
 			}
 		}
@@ -598,18 +650,25 @@ Cell *intest(Node **a, int n)	/* a[0] is index (list), a[1] is symtab */
  * Limited checking! This is a potential security hole.
  */
 
+/*
+ * The decoders look at no more than n bytes of s, so callers
+ * walking a long string can pass what is left of it instead of
+ * paying for a strlen on every character.  Without a length they
+ * stop at 4: a NUL is never a continuation byte, so they can't run
+ * off the end of a terminated string either.
+ */
+
 /* is s the beginning of a valid utf-8 string? */
 /* return length 1..4 if yes, 0 if no */
-int u8_isutf(const char *s)
+int u8_isutfn(const char *s, size_t n)
 {
-	int n, ret;
+	int ret;
 	unsigned char c;
 
 	c = s[0];
 	if (c < 128 || awk_mb_cur_max == 1)
 		return 1; /* what if it's 0? */
 
-	n = strlen(s);
 	if (n >= 2 && ((c>>5) & 0x7) == 0x6 && (s[1] & 0xC0) == 0x80) {
 		ret = 2; /* 110xxxxx 10xxxxxx */
 	} else if (n >= 3 && ((c>>4) & 0xF) == 0xE && (s[1] & 0xC0) == 0x80
@@ -624,12 +683,17 @@ int u8_isutf(const char *s)
 	return ret;
 }
 
+int u8_isutf(const char *s)
+{
+	return u8_isutfn(s, 4);
+}
+
 /* Convert (prefix of) utf8 string to utf-32 rune. */
 /* Sets *rune to the value, returns the length. */
 /* No error checking: watch out. */
-int u8_rune(int *rune, const char *s)
+int u8_runen(int *rune, const char *s, size_t n)
 {
-	int n, ret;
+	int ret;
 	unsigned char c;
 
 	c = s[0];
@@ -638,7 +702,6 @@ int u8_rune(int *rune, const char *s)
 		return 1;
 	}
 
-	n = strlen(s);
 	if (n >= 2 && ((c>>5) & 0x7) == 0x6 && (s[1] & 0xC0) == 0x80) {
 		*rune = ((c & 0x1F) << 6) | (s[1] & 0x3F); /* 110xxxxx 10xxxxxx */
 		ret = 2;
@@ -659,6 +722,11 @@ int u8_rune(int *rune, const char *s)
 	return ret; /* returns one byte if sequence doesn't look like utf */
 }
 
+int u8_rune(int *rune, const char *s)
+{
+	return u8_runen(rune, s, 4);
+}
+
 /* return length of next sequence: 1 for ascii or random, 2..4 for valid utf8 */
 int u8_nextlen(const char *s)
 {
@@ -682,8 +750,8 @@ int u8_strlen(const char *s)
 		c = s[i];
 		if (c < 128 || awk_mb_cur_max == 1) {
 			len = 1;
-		} else {
-			len = u8_nextlen(&s[i]);
+		} else if ((len = u8_isutfn(&s[i], n - i)) == 0) {
+			len = 1;
 		}
 		totlen++;
 		if (i > n)
@@ -809,12 +877,13 @@ Cell *matchop(Node **a, int n)	/* ~ and match() */
 	}
 	x = execute(a[1]);	/* a[1] = target text */
 	s = getsval(x);
-	if (a[0] == NULL)	/* a[1] == 0: already-compiled reg expr */
-		i = (*mf)((fa *) a[2], s);
-	else {
+	if (a[0] == NULL) {	/* a[1] == 0: already-compiled reg expr */
+		pfa = (fa *) a[2];
+		i = pfa->multi != NULL ? multimatch(pfa, s) : (*mf)(pfa, s);
+	} else {
 		y = execute(a[2]);	/* a[2] = regular expr */
 		t = getsval(y);
-		pfa = makedfa(t, mode);
+		pfa = sitedfa((Resite *) a[0], t, mode);
 		i = (*mf)(pfa, s);
 		tempfree(y);
 	}
@@ -891,6 +960,8 @@ Cell *relop(Node **a, int n)	/* a[0 < a[1], etc. */
 
 	x = execute(a[0]);
 	y = execute(a[1]);
+	checknum(x);
+	checknum(y);
 	x_is_nan = isnan(x->fval);
 	y_is_nan = isnan(y->fval);
 	if (x->tval&NUM && y->tval&NUM) {
@@ -1284,6 +1355,7 @@ int format(char **pbuf, int *pbufsize, const char *s, Node *a)	/* printf-like co
 			 * can't, we output the encoding of the Unicode
 			 * "invalid character", 0xFFFD.
 			 */
+			checknum(x);
 			if (isnum(x)) {
 				int charval = (int) getfval(x);
 
@@ -1545,9 +1617,12 @@ Cell *assign(Node **a, int n)	/* a[0] = a[1], a[0] += a[1], etc. */
 			x->fval = yf;
 			x->tval |= NUM;
 		}
-		else if (isstr(y))
+		else if (isstr(y)) {
+			int maybe = y->tval & MAYBENUM;	/* x may be y */
+
 			setsval(x, getsval(y));
-		else if (isnum(y))
+			x->tval |= maybe;
+		} else if (isnum(y))
 			setfval(x, getfval(y));
 		else
 			funnyvar(y, "read value of");
@@ -1625,13 +1700,33 @@ Cell *cat(Node **a, int q)	/* a[0] cat a[1] */
 	return(z);
 }
 
+static fa *multipat(Node *x)	/* if x is just $0 ~ /re/, with re in a Multi */
+{
+	Node *y;
+
+	if (isvalue(x) || x->nobj != NE || x->narg[1] != nullnode)
+		return NULL;
+	y = x->narg[0];
+	if (isvalue(y) || (y->nobj != MATCH && y->nobj != NOTMATCH)
+	  || y->narg[0] != NULL)
+		return NULL;
+	return ((fa *) y->narg[2])->multi != NULL ? (fa *) y->narg[2] : NULL;
+}
+
 Cell *pastat(Node **a, int n)	/* a[0] { a[1] } */
 {
 	Cell *x;
+	fa *pfa;
 
 	if (a[0] == NULL)
 		x = execute(a[1]);
-	else {
+	else if ((pfa = multipat(a[0])) != NULL) {	/* skip matchop */
+		if (multimatch(pfa, getsval(fieldadr(0)))
+		  == (a[0]->narg[0]->nobj == MATCH))
+			x = execute(a[1]);
+		else
+			x = False;
+	} else {
 		x = execute(a[0]);
 		if (istrue(x)) {
 			tempfree(x);
@@ -1664,20 +1759,42 @@ Cell *dopa2(Node **a, int n)	/* a[0], a[1] { a[2] } */
 	return(False);
 }
 
+static void boundarr(char *s, int n, Array *tp, bool csv)	/* tp[1..n] = fields found in s */
+{
+	char num[50];
+	char *t, *e, *p, *q;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		t = s + fsbound[2*i];
+		e = s + fsbound[2*i+1];
+		if (csv && t > s && t[-1] == '"') {	/* "" in "..." is " */
+			for (p = q = t; p < e; *q++ = *p++)
+				if (*p == '"' && p+1 < e && p[1] == '"')
+					p++;
+			e = q;
+		}
+		*e = '\0';
+		snprintf(num, sizeof(num), "%d", i+1);
+		setsymtab(num, t, 0.0, STR|MAYBENUM, tp);
+	}
+}
+
 Cell *split(Node **a, int nnn)	/* split(a[0], a[1], a[2]); a[3] is type */
+				/* a[4] is where a string's fa is kept */
 {
 	Cell *x = NULL, *y, *ap;
-	const char *s, *origs, *t;
+	const char *s;
+	char *origs;
 	const char *fs = NULL;
 	char *origfs = NULL;
 	int sep;
 	char temp, num[50];
 	int n, tempstat, arg3type;
 	int j;
-	double result;
 
 	y = execute(a[0]);	/* source string */
-	origs = s = strdup(getsval(y));
+	s = origs = strdup(getsval(y));
 	tempfree(y);
 	arg3type = ptoi(a[3]);
 	if (a[2] == NULL) {		/* BUG: CSV should override implicit fs but not explicit */
@@ -1707,12 +1824,16 @@ Cell *split(Node **a, int nnn)	/* split(a[0], a[1], a[2]); a[3] is type */
 		fs = "";
 		sep = 0;
 	}
-	if (*s != '\0' && (strlen(fs) > 1 || arg3type == REGEXPR)) {	/* reg expr */
+	if (*s != '\0' && arg3type != REGEXPR && relit(fs) > 1) {	/* just a string */
+		n = splitstr(s, strlen(s), fs, false, INT_MAX);
+		boundarr(origs, n, (Array *) ap->sval, false);
+
+	} else if (*s != '\0' && (strlen(fs) > 1 || arg3type == REGEXPR)) {	/* reg expr */
 		fa *pfa;
 		if (arg3type == REGEXPR) {	/* it's ready already */
 			pfa = (fa *) a[2];
 		} else {
-			pfa = makedfa(fs, 1);
+			pfa = sitedfa((Resite *) a[4], fs, 1);
 		}
 		if (nematch(pfa,s)) {
 			tempstat = pfa->initstat;
@@ -1722,10 +1843,7 @@ Cell *split(Node **a, int nnn)	/* split(a[0], a[1], a[2]); a[3] is type */
 				snprintf(num, sizeof(num), "%d", n);
 				temp = *patbeg;
 				setptr(patbeg, '\0');
-				if (is_number(s, & result))
-					setsymtab(num, s, result, STR|NUM, (Array *) ap->sval);
-				else
-					setsymtab(num, s, 0.0, STR, (Array *) ap->sval);
+				setsymtab(num, s, 0.0, STR|MAYBENUM, (Array *) ap->sval);
 				setptr(patbeg, temp);
 				s = patbeg + patlen;
 				if (*(patbeg+patlen-1) == '\0' || *s == '\0') {
@@ -1741,68 +1859,17 @@ Cell *split(Node **a, int nnn)	/* split(a[0], a[1], a[2]); a[3] is type */
 		}
 		n++;
 		snprintf(num, sizeof(num), "%d", n);
-		if (is_number(s, & result))
-			setsymtab(num, s, result, STR|NUM, (Array *) ap->sval);
-		else
-			setsymtab(num, s, 0.0, STR, (Array *) ap->sval);
+		setsymtab(num, s, 0.0, STR|MAYBENUM, (Array *) ap->sval);
   spdone:
 		pfa = NULL;
 
 	} else if (a[2] == NULL && CSV) {	/* CSV only if no explicit separator */
-		char *newt = (char *) malloc(strlen(s)); /* for building new string; reuse for each field */
-		for (;;) {
-			char *fr = newt;
-			n++;
-			if (*s == '"' ) { /* start of "..." */
-				for (s++ ; *s != '\0'; ) {
-					if (*s == '"' && s[1] != '\0' && s[1] == '"') {
-						s += 2; /* doubled quote */
-						*fr++ = '"';
-					} else if (*s == '"' && (s[1] == '\0' || s[1] == ',')) {
-						s++; /* skip over closing quote */
-						break;
-					} else {
-						*fr++ = *s++;
-					}
-				}
-				*fr++ = 0;
-			} else {	/* unquoted field */
-				while (*s != ',' && *s != '\0')
-					*fr++ = *s++;
-				*fr++ = 0;
-			}
-			snprintf(num, sizeof(num), "%d", n);
-			if (is_number(newt, &result))
-				setsymtab(num, newt, result, STR|NUM, (Array *) ap->sval);
-			else
-				setsymtab(num, newt, 0.0, STR, (Array *) ap->sval);
-			if (*s++ == '\0')
-				break;
-		}
-		free(newt);
-
-	} else if (!CSV && sep == ' ') { /* usual case: split on white space */
-		for (n = 0; ; ) {
-#define ISWS(c)	((c) == ' ' || (c) == '\t' || (c) == '\n')
-			while (ISWS(*s))
-				s++;
-			if (*s == '\0')
-				break;
-			n++;
-			t = s;
-			do
-				s++;
-			while (*s != '\0' && !ISWS(*s));
-			temp = *s;
-			setptr(s, '\0');
-			snprintf(num, sizeof(num), "%d", n);
-			if (is_number(t, & result))
-				setsymtab(num, t, result, STR|NUM, (Array *) ap->sval);
-			else
-				setsymtab(num, t, 0.0, STR, (Array *) ap->sval);
-			setptr(s, temp);
-			if (*s != '\0')
-				s++;
+		if (*s == '\0') {	/* still one empty field */
+			n = 1;
+			setsymtab("1", "", 0.0, STR|MAYBENUM, (Array *) ap->sval);
+		} else {
+			n = splitcsv(s, strlen(s), fs, false, INT_MAX);
+			boundarr(origs, n, (Array *) ap->sval, true);
 		}
 
 	} else if (sep == 0) {	/* new: split(s, a, "") => 1 char/elem */
@@ -1822,23 +1889,12 @@ Cell *split(Node **a, int nnn)	/* split(a[0], a[1], a[2]); a[3] is type */
 				setsymtab(num, buf, 0.0, STR, (Array *) ap->sval);
 		}
 
-	} else if (*s != '\0') {  /* some random single character */
-		for (;;) {
-			n++;
-			t = s;
-			while (*s != sep && *s != '\0')
-				s++;
-			temp = *s;
-			setptr(s, '\0');
-			snprintf(num, sizeof(num), "%d", n);
-			if (is_number(t, & result))
-				setsymtab(num, t, result, STR|NUM, (Array *) ap->sval);
-			else
-				setsymtab(num, t, 0.0, STR, (Array *) ap->sval);
-			setptr(s, temp);
-			if (*s++ == '\0')
-				break;
-		}
+	} else {	/* white space, or some random single character */
+		if (!CSV && sep == ' ')
+			n = splitws(s, strlen(s), fs, false, INT_MAX);
+		else
+			n = splitch(s, strlen(s), fs, false, INT_MAX);
+		boundarr(origs, n, (Array *) ap->sval, false);
 	}
 	tempfree(ap);
 	xfree(origs);
@@ -2350,6 +2406,8 @@ Cell *closefile(Node **a, int n)
 			else
 				WARNING("i/o error occurred on %s", files[i].fname);
 		}
+		if (files[i].mode == LT || files[i].mode == LE)
+			inbufclose(files[i].fp);
 		if (files[i].fp == stdin || files[i].fp == stdout ||
 		    files[i].fp == stderr)
 			stat = freopen("/dev/null", "r+", files[i].fp) == NULL;
@@ -2432,7 +2490,7 @@ Cell *dosub(Node **a, int subop)        /* sub and gsub */
 		pfa = (fa *) a[1];
 	} else {
 		x = execute(a[1]);
-		pfa = makedfa(getsval(x), 1);
+		pfa = sitedfa((Resite *) a[0], getsval(x), 1);
 		tempfree(x);
 	}
 
@@ -321,7 +321,7 @@ Awkfloat setfval(Cell *vp, Awkfloat f)	/* set float val of a Cell */
 	}
 	if (freeable(vp))
 		xfree(vp->sval); /* free any previous string */
-	vp->tval &= ~(STR|CONVC|CONVO); /* mark string invalid */
+	vp->tval &= ~(STR|CONVC|CONVO|MAYBENUM); /* mark string invalid */
 	vp->fmt = NULL;
 	vp->tval |= NUM;	/* mark number ok */
 	if (f == -0)  /* who would have thought this possible? */
@@ -371,7 +371,7 @@ char *setsval(Cell *vp, const char *s)	/* set string val of a Cell */
 	t = s ? tostring(s) : tostring("");	/* in case it's self-assign */
 	if (freeable(vp))
 		xfree(vp->sval);
-	vp->tval &= ~(NUM|DONTFREE|CONVC|CONVO);
+	vp->tval &= ~(NUM|DONTFREE|CONVC|CONVO|MAYBENUM);
 	vp->tval |= STR;
 	vp->fmt = NULL;
 	DPRINTF("setsval %p: %s = \"%s (%p) \", t=%o r,f=%d,%d\n",
@@ -387,6 +387,26 @@ char *setsval(Cell *vp, const char *s)	/* set string val of a Cell */
 	return(vp->sval);
 }
 
+/*
+ * Input ($0, fields, getline var, split elements) is only checked
+ * for looking like a number, which makes it a strnum, when a value
+ * is wanted: getfval, comparison or truth test.  Until then it is
+ * marked MAYBENUM.
+ */
+
+void checknum(Cell *vp)	/* settle whether a MAYBENUM string is a number */
+{
+	double result;
+
+	if ((vp->tval & MAYBENUM) == 0)
+		return;
+	vp->tval &= ~MAYBENUM;
+	if (is_number(vp->sval, & result)) {
+		vp->fval = result;
+		vp->tval |= NUM;
+	}
+}
+
 Awkfloat getfval(Cell *vp)	/* get float val of a Cell */
 {
 	if ((vp->tval & (NUM | STR)) == 0)
@@ -395,6 +415,7 @@ Awkfloat getfval(Cell *vp)	/* get float val of a Cell */
 		fldbld();
 	else if (isrec(vp) && !donerec)
 		recbld();
+	checknum(vp);
 	if (!isnum(vp)) {	/* not a number */
 		double fval;
 		bool no_trailing;
@@ -631,6 +652,8 @@ const char *flags2str(int flags)
 		{ "REC", REC },
 		{ "CONVC", CONVC },
 		{ "CONVO", CONVO },
+		{ "LAZY", LAZY },
+		{ "MAYBENUM", MAYBENUM },
 		{ NULL, 0 }
 	};
 	static char buf[100];